@@ -0,0 +1,332 @@
+#!/usr/bin/env python3
+# benchmarks for smallsh, run by "make bench" (or "python3 bench.py ./smallsh")
+# Most benchmarks run the shell in a pseudo terminal and type a scripted session into it like a user would,
+# so it goes through the prompt, read_line() and the interactive reporting just like a real session.
+# First a few correctness checks of the interactive behaviour (^Z, ^C, status) run the same way,
+# a failed one is printed to stderr and makes the exit status 1.
+# Each benchmark runs --repeat times (5 by default) and its result is printed as one JSON object per line,
+# with "name", the median run's "value" and its "unit", the "min" and "max" of all the runs, whether "higher" values
+# are better, and for some a "noise" level that changes smaller than that are within.
+# With --baseline old.jsonl (the output of an earlier run) it exits with 1 if any median is more than
+# --tolerance (10% by default) worse than it was, or more than the baseline runs' spread if that's wider, see regressions().
+# A benchmark that finds the shell doing something wrong (CheckFailed) is reported like a failed check instead of a result.
+# referenced from https://docs.python.org/3/library/pty.html
+
+import argparse
+import json
+import os
+import pty
+import select
+import statistics
+import subprocess
+import sys
+import tempfile
+import termios
+import time
+
+# matches MAXINPUT in smallsh.c
+MAXINPUT = 2048
+
+
+# raised by a benchmark when the shell got something wrong, main() reports it like a failed interactive check
+class CheckFailed(Exception):
+    pass
+
+
+# start the shell in a pseudo terminal, with echo turned off so we only read what the shell writes,
+# returns its pid and the fd for the terminal's master side
+def start_shell(shell, args):
+    pid, fd = pty.fork()
+    if pid == 0:
+        os.execv(shell, [shell] + args)
+    attributes = termios.tcgetattr(fd)
+    attributes[3] &= ~termios.ECHO
+    termios.tcsetattr(fd, termios.TCSANOW, attributes)
+    return pid, fd
+
+
+# type lines into the shell while collecting what it writes back, until until(output) is true
+# (or the shell exits). The terminal only holds so much unread input, so the writes are interleaved with reads.
+# Returns the output and when each of the markers in watch first showed up in it
+def session(fd, lines, until, watch=()):
+    pending = "".join(line + "\n" for line in lines).encode()
+    output = b""
+    seen = {}
+    while True:
+        writable = [fd] if pending else []
+        readable, writable, _ = select.select([fd], writable, [], 60)
+        if not readable and not writable:
+            raise RuntimeError("shell stopped responding, output so far: %r" % output[-500:])
+        if writable:
+            # a line at a time, a terminal in canonical mode won't take a partial line past its buffer size
+            end = pending.find(b"\n") + 1
+            written = os.write(fd, pending[:end])
+            pending = pending[written:]
+        if readable:
+            try:
+                data = os.read(fd, 65536)
+            except OSError:
+                # the shell exited (EIO on the master side)
+                break
+            if not data:
+                break
+            output += data
+            now = time.monotonic()
+            for marker in watch:
+                if marker not in seen and marker.encode() in output:
+                    seen[marker] = now
+            if until(output):
+                break
+    return output, seen
+
+
+def finish(pid, fd):
+    try:
+        os.write(fd, b"exit\n")
+        os.waitpid(pid, 0)
+    finally:
+        os.close(fd)
+
+
+# correctness checks of the interactive behaviour the benchmarks go around: ^Z toggling foreground-only mode,
+# at the prompt and while a foreground command runs, & being ignored in that mode, and status after
+# an exit value and after ^C. Returns what failed, if anything
+def interactive_checks(shell):
+    pid, fd = start_shell(shell, [])
+    failed = []
+
+    # type the lines, then an echo of marker to know they're all done, returns what the shell wrote until then
+    def run(lines, marker):
+        output, _ = session(fd, lines + ["echo " + marker], lambda output: marker.encode() in output)
+        return output
+
+    # start a foreground command, then press a key (^Z, ^C) while it runs
+    def interrupt(command, key):
+        os.write(fd, (command + "\n").encode())
+        time.sleep(0.3)
+        os.write(fd, key)
+
+    run([], "ready")
+    os.write(fd, b"\x1a")
+    output, _ = session(fd, [], lambda output: b"foreground-only mode" in output)
+    if b"Entering foreground-only mode (& is now ignored)" not in output:
+        failed.append("^Z at the prompt didn't enter foreground-only mode")
+    if b"Background pid" in run(["sleep 0.1 &"], "ignored-done"):
+        failed.append("& wasn't ignored in foreground-only mode")
+    interrupt("sleep 1", b"\x1a")
+    if b"Exiting foreground-only mode (& is now allowed)" not in run([], "tstp-done"):
+        failed.append("^Z during a foreground command didn't exit foreground-only mode")
+    if b"Background pid" not in run(["sleep 0.1 &", "wait"], "allowed-done"):
+        failed.append("& wasn't allowed again after foreground-only mode")
+    if b"exit value 1" not in run(["false", "status"], "false-done"):
+        failed.append("status after false didn't say \"exit value 1\"")
+    interrupt("sleep 5", b"\x03")
+    # once from the shell when the command is killed, once from status
+    if run(["status"], "interrupt-done").count(b"terminated by signal 2") != 2:
+        failed.append("^C during a foreground command wasn't reported as \"terminated by signal 2\"")
+    finish(pid, fd)
+    return failed
+
+
+# commands per second, one foreground /bin/true after the other, with the given launcher (-l fork or -l spawn)
+def spawn_rate(shell, launcher, count):
+    pid, fd = start_shell(shell, ["-l", launcher])
+    session(fd, ["echo ready"], lambda output: b"ready" in output)
+    started = time.monotonic()
+    session(fd, ["/bin/true"] * count + ["echo spawn-done"], lambda output: b"spawn-done" in output)
+    elapsed = time.monotonic() - started
+    finish(pid, fd)
+    return {"name": "spawn_rate_" + launcher, "value": count / elapsed, "unit": "commands/s", "higher": True}
+
+
+# microseconds per command, typing the same one count times: "true" runs inside the shell,
+# "/bin/true" is the same command forked off (with the default launcher), the difference is what a built in saves
+def command_latency(shell, command, name, count):
+    pid, fd = start_shell(shell, [])
+    session(fd, ["echo ready"], lambda output: b"ready" in output)
+    started = time.monotonic()
+    session(fd, [command] * count + ["echo latency-done"], lambda output: b"latency-done" in output)
+    elapsed = time.monotonic() - started
+    finish(pid, fd)
+    return {"name": "command_latency_" + name, "value": elapsed / count * 1e6, "unit": "us", "higher": False}
+
+
+# how long it takes to reap and report count background commands that all finish at about the same time:
+# from when the last one should have finished (it was started last and sleeps for the same time) until "wait" returns
+def background_reporting(shell, count, seconds):
+    pid, fd = start_shell(shell, [])
+    session(fd, ["echo ready"], lambda output: b"ready" in output)
+    lines = ["/bin/sleep %g &" % seconds] * count + ["echo launched", "wait", "echo reported"]
+    output, seen = session(fd, lines, lambda output: b"reported" in output, watch=("launched", "reported"))
+    finish(pid, fd)
+    done = output.count(b"is done: exit value 0")
+    if done != count:
+        raise CheckFailed("expected %d background completions, got %d" % (count, done))
+    latency = seen["reported"] - seen["launched"] - seconds
+    # a millisecond or two either way is just scheduling
+    return {"name": "background_reporting_%d" % count, "value": max(latency, 0) * 1000, "unit": "ms", "higher": False, "noise": 5}
+
+
+# peak RSS in KB of a shell parsing lines (-n) of every kind, long and short, quoted, pipelines and redirections.
+# The script comes through a pipe, a -f file would be memory-mapped and its pages would count too.
+# wait4()'s ru_maxrss would include what this (much bigger) process had before the fork and exec,
+# so it's the shell's own high water mark from /proc, read once it has parsed everything and is waiting for more input
+def parse_rss(shell, count):
+    lines = ["echo short", "a | b | c > out 2>&1 < in", "echo 'single quoted $$' \"double $$\" tail",
+             "echo" + " $$" * (MAXINPUT // 3 - 2), "cat" + " word" * (MAXINPUT // 5 - 1), "sleep 1 &", "# comment", ""]
+    text = "".join(lines[j % len(lines)] + "\n" for j in range(count)).encode()
+    shell_process = subprocess.Popen([shell, "-n", "-f", "/dev/stdin"], stdin=subprocess.PIPE,
+                                     stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        shell_process.stdin.write(text)
+        shell_process.stdin.flush()
+        while True:
+            with open("/proc/%d/io" % shell_process.pid) as io:
+                read = int(next(line for line in io if line.startswith("rchar:")).split()[1])
+            with open("/proc/%d/stat" % shell_process.pid) as stat:
+                state = stat.read().rsplit(")", 1)[1].split()[0]
+            if read >= len(text) and state == "S":
+                break
+            time.sleep(0.01)
+        with open("/proc/%d/status" % shell_process.pid) as status:
+            peak = int(next(line for line in status if line.startswith("VmHWM:")).split()[1])
+    finally:
+        shell_process.stdin.close()
+        shell_process.wait()
+    return peak
+
+
+# how much more memory parsing 10 times the lines takes, which should be nothing:
+# the parser's arrays only grow to fit the longest line, not with the number of lines
+def parse_memory(shell, count):
+    growth = parse_rss(shell, count * 10) - parse_rss(shell, count)
+    # allocator and page granularity
+    noise = 256
+    if growth > 4 * noise:
+        raise CheckFailed("parsing %d lines took %d KB more memory than %d lines" % (count * 10, growth, count))
+    return {"name": "parse_memory_growth", "value": max(growth, 0), "unit": "KB", "higher": False, "noise": noise}
+
+
+# gigabytes per second moved through a redirection-only pipeline, "< file | > /dev/null", with -s (splice) or without it
+# (read/write through a buffer). The file is sparse so setting it up costs nothing and reading it doesn't wait for the disk
+def pipe_throughput(shell, splice, gigabytes):
+    data = tempfile.NamedTemporaryFile(suffix=".bin", delete=False)
+    with data:
+        data.truncate(int(gigabytes * (1 << 30)))
+    try:
+        pid, fd = start_shell(shell, ["-s"] if splice else [])
+        session(fd, ["echo ready"], lambda output: b"ready" in output)
+        started = time.monotonic()
+        session(fd, ["< %s | > /dev/null" % data.name, "echo pipe-done"], lambda output: b"pipe-done" in output)
+        elapsed = time.monotonic() - started
+        finish(pid, fd)
+    finally:
+        os.unlink(data.name)
+    return {"name": "pipe_throughput_" + ("splice" if splice else "copy"), "value": gigabytes / elapsed, "unit": "GB/s", "higher": True}
+
+
+# lines per second parsed with -n (parse only), each one MAXINPUT characters long and mostly $$ expansions.
+# This one is fed from a script (-f) instead of the terminal: a terminal takes one line at a time,
+# and that would be what gets measured, not the parser
+def parse_rate(shell, count):
+    line = "echo"
+    while len(line) + 3 <= MAXINPUT:
+        line += " $$"
+    script = tempfile.NamedTemporaryFile("w", suffix=".sh", delete=False)
+    with script:
+        script.write((line + "\n") * count)
+    try:
+        pid, fd = start_shell(shell, ["-n", "-f", script.name])
+        started = time.monotonic()
+        # with -n nothing runs, so the end of the session is the shell exiting
+        session(fd, [], lambda output: False)
+        elapsed = time.monotonic() - started
+        os.waitpid(pid, 0)
+        os.close(fd)
+    finally:
+        os.unlink(script.name)
+    return {"name": "parse_rate_maxinput", "value": count / elapsed, "unit": "lines/s", "higher": True}
+
+
+# run a benchmark repeat times, the result is the median run's, with the lowest and highest values of all of them
+def repeated(benchmark, repeat):
+    runs = [benchmark() for _ in range(repeat)]
+    values = sorted(run["value"] for run in runs)
+    result = dict(runs[0])
+    result.update(value=statistics.median(values), min=values[0], max=values[-1], runs=repeat)
+    return result
+
+
+# how far apart a result's runs were, relative to its median (0 for a single run)
+def spread(result):
+    if not result["value"]:
+        return 0
+    return (result.get("max", result["value"]) - result.get("min", result["value"])) / result["value"]
+
+
+# compare results with an earlier run's, returns the names of the ones that got worse by more than tolerance.
+# A change within how much the baseline's repeats varied is noise too, however small tolerance is
+# (only the baseline's: a new build that's slower and noisier mustn't be let off for being noisy)
+def regressions(results, baseline_path, tolerance):
+    with open(baseline_path) as baseline_file:
+        baseline = {result["name"]: result for result in map(json.loads, baseline_file) if "name" in result}
+    worse = []
+    for result in results:
+        old = baseline.get(result["name"])
+        if not old or not old["value"]:
+            continue
+        if abs(result["value"] - old["value"]) < result.get("noise", 0):
+            continue
+        change = (result["value"] - old["value"]) / old["value"]
+        allowed = max(tolerance, spread(old))
+        if (change < -allowed) if result["higher"] else (change > allowed):
+            worse.append(result["name"])
+    return worse
+
+
+def main():
+    parser = argparse.ArgumentParser(description="smallsh benchmarks, results as JSON lines")
+    parser.add_argument("shell", nargs="?", default="./smallsh")
+    parser.add_argument("--commands", type=int, default=2000, help="commands for the spawn rate benchmarks")
+    parser.add_argument("--background", type=int, default=500, help="background commands to reap at once")
+    parser.add_argument("--lines", type=int, default=50000, help="lines for the parser benchmark")
+    parser.add_argument("--splice-gb", type=float, default=2, help="gigabytes for the pipe throughput benchmarks")
+    parser.add_argument("--repeat", type=int, default=5, help="runs of each benchmark, the median is the result")
+    parser.add_argument("--baseline", help="earlier results to compare against")
+    parser.add_argument("--tolerance", type=float, default=0.1, help="how much worse than the baseline is too much")
+    options = parser.parse_args()
+    shell = os.path.abspath(options.shell)
+
+    failed = interactive_checks(shell)
+    for failure in failed:
+        print("check failed: %s" % failure, file=sys.stderr)
+
+    results = []
+    for benchmark in (lambda: spawn_rate(shell, "fork", options.commands),
+                      lambda: spawn_rate(shell, "spawn", options.commands),
+                      lambda: command_latency(shell, "true", "builtin", options.commands),
+                      lambda: command_latency(shell, "/bin/true", "external", options.commands),
+                      lambda: background_reporting(shell, options.background, 1.0),
+                      lambda: parse_rate(shell, options.lines),
+                      lambda: parse_memory(shell, options.lines),
+                      lambda: pipe_throughput(shell, False, options.splice_gb),
+                      lambda: pipe_throughput(shell, True, options.splice_gb)):
+        try:
+            result = repeated(benchmark, options.repeat)
+        except CheckFailed as failure:
+            failed.append(str(failure))
+            print("check failed: %s" % failure, file=sys.stderr)
+            continue
+        results.append(result)
+        print(json.dumps(result), flush=True)
+
+    worse = []
+    if options.baseline:
+        worse = regressions(results, options.baseline, options.tolerance)
+        for name in worse:
+            print("regression: %s" % name, file=sys.stderr)
+    sys.exit(1 if failed or worse else 0)
+
+
+if __name__ == "__main__":
+    main()
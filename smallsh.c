@@ -1,3 +1,5 @@
+// splice(), pipe2() and F_SETPIPE_SZ are Linux extensions
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
@@ -7,15 +9,210 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include <spawn.h>
+#include <sched.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <poll.h>
+#include <ctype.h>
+#include <limits.h>
 
-#define MAXINPUT 2048 //shell must support command lines with a maximum length of 2048 characters
-#define MAXARGS 512 //and a maximum of 512 arguments
+#define MAXINPUT 2048 //shell must support command lines of at least 2048 characters (longer ones work too, the buffers grow)
+#define PUMP_CHUNK (1 << 20) // how much a redirection-only pipeline stage moves at a time, see pump()
+#define SPOOL_SIZE (64 << 10) // how much of a background command's output is kept in memory before it spills to a file, see drain_spool()
 
 // establish a 0/1 int to act as a boolean for whether foreground only mode is off or on
 int foreground_only = 0;
 
-// create processes array of for storing background processes
-int processes[5];
+// 0/1 for whether pipeline stages with no command move their data with splice(2), set by the -s option
+int splice_mode = 0;
+
+// 0/1 for whether to only parse commands without running them, set by the -n option (like sh -n)
+int parse_only = 0;
+
+// 0/1 for whether to launch commands with fork() + execvp() instead of posix_spawn(), set by "-l fork"
+int use_fork = 0;
+
+// script mode, set by the -f option: commands come from a file, and there's no prompt
+int batch_mode = 0;
+// fd that read_line() reads commands from, stdin unless -f names something that can't be memory-mapped
+int input_fd = STDIN_FILENO;
+
+// how many foreground commands may run at once, set by the -j option.
+// With more than 1, each command is started as soon as a slot is free instead of being waited for,
+// see the fork if/else block in main
+int max_jobs = 1;
+int running_scheduled_jobs = 0;
+
+// server mode (--serve): the connection this worker process is reading commands from and sending statuses back on,
+// -1 when we're an ordinary shell, see serve() and serve_reply()
+int serve_fd = -1;
+
+// exit status of the last foreground command, shown by the status command
+int foreground_exit_status = 0;
+
+// exit statuses of every foreground command, for the summary printed at the end of a script (or a -j session)
+unsigned long commands_run = 0;
+unsigned long exit_counts[256];
+unsigned long signal_counts[NSIG];
+
+// resources used by a command: wall clock time from launch until its last stage was reaped,
+// plus the rusage from wait4(), added up over every stage of a pipeline
+struct usage {
+    struct timespec start;
+    struct timespec end;
+    struct rusage rusage;
+};
+
+// resources used by the last foreground command, shown by "status -v"
+struct usage foreground_usage;
+
+// 0/1 for whether "Background pid is done" messages include the resource usage, set by the -v option
+int verbose_jobs = 0;
+
+// 0/1 for whether background commands' output (stdout and stderr) is collected by the shell instead of going
+// straight to the terminal, set by the -o option. It's shown with the "Background pid is done" message, see struct spool
+int spool_output = 0;
+
+// one command in the trace ring buffer, see trace_begin().
+// Timestamps are CLOCK_MONOTONIC nanoseconds, 0 if that point hasn't been reached (yet)
+struct trace_record {
+    // which command this is (counting from 1), so a job can tell if its record has been overwritten
+    uint64_t seq;
+    // pid of the last stage
+    pid_t pid;
+    int stages;
+    // raw wait status, -1 until the command has been reaped
+    int exit_status;
+    // when the shell started parsing the line, started launching the command,
+    // when the (last) stage exec'd, when the shell started waiting for it, and when it was reaped
+    int64_t parse;
+    int64_t spawn;
+    int64_t exec;
+    int64_t wait;
+    int64_t reap;
+    // the start of the command line, for telling commands apart
+    char command[64];
+};
+
+// the trace ring buffer, only allocated when SMALLSH_TRACE is set (to the number of records to keep).
+// It's shared memory so a forked child can stamp its exec time in its record right before execv()
+struct trace_record* trace_ring = NULL;
+size_t trace_capacity = 0;
+uint64_t trace_count = 0;
+// when parsing of the current line started, and the record of the command being launched right now
+int64_t trace_parse_started = 0;
+struct trace_record* current_trace = NULL;
+
+// a background process, stored in the job table below (keyed by its pid)
+struct job {
+    pid_t pid;
+    // filled in by wait4() once the job has been reaped
+    int exit_status;
+    // every stage of a pipeline gets its own job, they all point to the last stage's job (the leader, which has NULL here).
+    // The leader collects the whole pipeline's exit status and usage,
+    // and is only reported once all stages_left of its stages have been reaped.
+    // The other stages are chained off the leader through next_member, and freed along with it
+    struct job* leader;
+    struct job* next_member;
+    int stages_left;
+    // 0/1 for whether this process has been reaped (and so mustn't be signalled anymore)
+    int reaped;
+    // when the job runs out of time (CLOCK_MONOTONIC nanoseconds, 0 for no deadline), only set on leaders,
+    // and where it is in the deadline heap, see handle_deadlines()
+    int64_t deadline;
+    size_t heap_index;
+    // 0 while running, 1 once SIGTERM has been sent for the deadline, 2 once SIGKILL has been sent
+    int kill_stage;
+    // 0/1 for whether it's being stopped because the shell is exiting (not because it ran out of time), see exit_jobs()
+    int shutdown;
+    // the process group of a background or -j scheduled command (the first stage's pid, every stage is in it),
+    // 0 for foreground ones, which stay in the shell's group so ^C from the terminal reaches them,
+    // unless the shell isn't reading a terminal, see run_pipeline(). Only set on leaders
+    pid_t pgid;
+    struct usage usage;
+    // 0/1 for whether to skip the "Background pid is done" message, for scheduled foreground commands
+    int quiet;
+    // 0/1 for whether this is the foreground command the shell is waiting for,
+    // run_pipeline() takes care of it once it's done instead of it being reported
+    int foreground;
+    // 0/1 for whether the command had a time prefix, so its usage gets printed with the "done" message
+    int timed;
+    // the command's record in the trace ring buffer (if tracing), and its seq, to check it hasn't been overwritten since
+    struct trace_record* trace;
+    uint64_t trace_seq;
+    // with -o, where a background command's output is being collected, only set on leaders
+    struct spool* spool;
+    // 0/1 for whether this is a foreground command started by the -j scheduler,
+    // these take up a slot until they finish (only the last stage of a pipeline is marked)
+    int scheduled;
+    // next job in the same hash bucket
+    struct job* hash_next;
+    // previous/next job in launch order, so we can walk every job (e.g. on exit)
+    struct job* prev;
+    struct job* next;
+};
+
+// job table for storing background processes:
+// a chained hash table keyed by pid, so insert/find/remove are all O(1),
+// which doubles its bucket array whenever it gets too full, so there is no limit on the number of jobs
+struct job_table {
+    struct job** buckets;
+    size_t bucket_count;
+    size_t count;
+    struct job* head;
+    struct job* tail;
+};
+struct job_table jobs = {0};
+
+// jobs that have been reaped but not reported to the user yet,
+// in the order they finished (linked through their next pointers)
+struct job* done_head = NULL;
+struct job* done_tail = NULL;
+
+// deadline for every external command, in seconds, set by the -t option (0 for none),
+// and how long a timed out command gets after SIGTERM before it gets SIGKILL, set by -k
+double default_timeout = 0;
+double kill_grace = 5;
+// how many commands timed out, for the summary
+unsigned long timeouts = 0;
+// 0/1 for whether the last foreground command was killed for running past its deadline, shown by status
+int foreground_timed_out = 0;
+
+// deadline heap: a binary min-heap of the jobs that have a deadline, ordered by deadline,
+// so the next one to expire is always deadlines[0] and the timerfd only ever needs to be armed for that one
+struct job** deadlines = NULL;
+size_t deadline_count = 0;
+size_t deadline_capacity = 0;
+int timer_fd = -1;
+// what the timerfd is armed for right now (0 for disarmed), so we only re-arm it when that changes
+int64_t timer_armed = 0;
+
+// the shell's event loop: one epoll instance watching sigchld_fd and timer_fd,
+// and a second one watching the same two plus the input, for when we're waiting at the prompt.
+// input_pollable is 0 if the input is a regular file (epoll can't watch those, but they never block anyway)
+// referenced from https://man7.org/linux/man-pages/man7/epoll.7.html
+int events_fd = -1;
+int input_events_fd = -1;
+int input_pollable = 1;
+
+// SIGCHLD is blocked in the shell and delivered through this signalfd instead,
+// so finished background processes are reaped as soon as they exit, not just before the next prompt
+// referenced from https://man7.org/linux/man-pages/man2/signalfd.2.html
+sigset_t sigchld_mask;
+int sigchld_fd = -1;
 
 // signal handler for SIGINT
 // referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-signal-handling-api?module_item_id=22511478
@@ -28,16 +225,3272 @@ void handle_SIGTSTP(int signo){
         fflush(stdout);
         foreground_only = 1;
     }
-    else {
-        char* message = "Exiting foreground-only mode (& is now allowed)\n";
-        // We are using write rather than printf
-        write(STDOUT_FILENO, message, 48);
+    else {
+        char* message = "Exiting foreground-only mode (& is now allowed)\n";
+        // We are using write rather than printf
+        write(STDOUT_FILENO, message, 48);
+        fflush(stdout);
+        foreground_only = 0;
+    }
+}
+
+// make sure buffer has room for needed items of the given size, doubling its capacity until it does,
+// buffers only ever grow, so once one is big enough it never gets reallocated again
+void* grow(void* buffer, size_t* capacity, size_t needed, size_t size){
+    if (needed <= *capacity){
+        return buffer;
+    }
+    size_t new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < needed){
+        new_capacity *= 2;
+    }
+    buffer = realloc(buffer, new_capacity * size);
+    if (!buffer){
+        perror("smallsh: realloc");
+        exit(1);
+    }
+    *capacity = new_capacity;
+    return buffer;
+}
+
+// hash a pid into a bucket index, bucket_count is always a power of 2
+// (multiplicative hashing, so sequential pids spread out over the table)
+size_t job_bucket(pid_t pid, size_t bucket_count){
+    return ((size_t) pid * 2654435761u) & (bucket_count - 1);
+}
+
+// double the bucket array and rehash every job into it
+void job_table_grow(void){
+    size_t new_count = jobs.bucket_count ? jobs.bucket_count * 2 : 64;
+    struct job** new_buckets = calloc(new_count, sizeof(struct job*));
+    if (!new_buckets){
+        perror("smallsh: calloc");
+        exit(1);
+    }
+    // the launch order list holds every job, so just walk it to rehash
+    for (struct job* job = jobs.head; job; job = job->next){
+        size_t b = job_bucket(job->pid, new_count);
+        job->hash_next = new_buckets[b];
+        new_buckets[b] = job;
+    }
+    free(jobs.buckets);
+    jobs.buckets = new_buckets;
+    jobs.bucket_count = new_count;
+}
+
+// add a new background process to the job table
+struct job* job_add(pid_t pid){
+    // keep the load factor under 1
+    if (jobs.count >= jobs.bucket_count){
+        job_table_grow();
+    }
+    struct job* job = calloc(1, sizeof(struct job));
+    if (!job){
+        perror("smallsh: calloc");
+        exit(1);
+    }
+    job->pid = pid;
+
+    size_t b = job_bucket(pid, jobs.bucket_count);
+    job->hash_next = jobs.buckets[b];
+    jobs.buckets[b] = job;
+
+    job->prev = jobs.tail;
+    if (jobs.tail){
+        jobs.tail->next = job;
+    }
+    else{
+        jobs.head = job;
+    }
+    jobs.tail = job;
+    jobs.count++;
+    return job;
+}
+
+// look up a job by pid, returns NULL if it isn't one of ours
+struct job* job_find(pid_t pid){
+    if (!jobs.count){
+        return NULL;
+    }
+    for (struct job* job = jobs.buckets[job_bucket(pid, jobs.bucket_count)]; job; job = job->hash_next){
+        if (job->pid == pid){
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// unlink a job from the table (the caller owns it afterwards)
+void job_remove(struct job* job){
+    struct job** link = &jobs.buckets[job_bucket(job->pid, jobs.bucket_count)];
+    while (*link != job){
+        link = &(*link)->hash_next;
+    }
+    *link = job->hash_next;
+
+    if (job->prev){
+        job->prev->next = job->next;
+    }
+    else{
+        jobs.head = job->next;
+    }
+    if (job->next){
+        job->next->prev = job->prev;
+    }
+    else{
+        jobs.tail = job->prev;
+    }
+    job->hash_next = job->prev = job->next = NULL;
+    jobs.count--;
+}
+
+// CLOCK_MONOTONIC in nanoseconds, for trace timestamps
+int64_t trace_now(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// set up the trace ring buffer if SMALLSH_TRACE is set,
+// to the number of commands to keep (anything that isn't a positive number means 4096)
+// referenced from https://man7.org/linux/man-pages/man2/mmap.2.html
+void trace_init(void){
+    const char* setting = getenv("SMALLSH_TRACE");
+    if (!setting){
+        return;
+    }
+    char* end;
+    long capacity = strtol(setting, &end, 10);
+    if (*end || capacity <= 0){
+        capacity = 4096;
+    }
+    trace_ring = mmap(NULL, capacity * sizeof(struct trace_record), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (trace_ring == MAP_FAILED){
+        perror("smallsh: trace");
+        trace_ring = NULL;
+        return;
+    }
+    trace_capacity = capacity;
+}
+
+// start a new trace record for a command that's about to be launched, overwriting the oldest one if the ring is full.
+// Returns NULL if tracing is off
+struct trace_record* trace_begin(char** args, int stage_count){
+    if (!trace_ring){
+        return NULL;
+    }
+    struct trace_record* record = &trace_ring[trace_count % trace_capacity];
+    memset(record, 0, sizeof(*record));
+    record->seq = ++trace_count;
+    record->stages = stage_count;
+    record->exit_status = -1;
+    record->parse = trace_parse_started;
+    record->spawn = trace_now();
+    // copy as many of the first stage's words as fit
+    size_t used = 0;
+    for (int j = 0; args[j] && used < sizeof(record->command) - 1; j++){
+        if (j){
+            record->command[used++] = ' ';
+        }
+        size_t length = strnlen(args[j], sizeof(record->command) - 1 - used);
+        memcpy(record->command + used, args[j], length);
+        used += length;
+    }
+    record->command[used] = '\0';
+    return record;
+}
+
+// a job's trace record, or NULL if it has none (or it got overwritten since)
+struct trace_record* job_trace(struct job* job){
+    if (job->trace && job->trace->seq == job->trace_seq){
+        return job->trace;
+    }
+    return NULL;
+}
+
+// write a string as a JSON string
+void json_string(FILE* stream, const char* string){
+    putc('"', stream);
+    for (; *string; string++){
+        unsigned char c = *string;
+        if (c == '"' || c == '\\'){
+            fprintf(stream, "\\%c", c);
+        }
+        else if (c < 0x20){
+            fprintf(stream, "\\u%04x", c);
+        }
+        else{
+            putc(c, stream);
+        }
+    }
+    putc('"', stream);
+}
+
+// write the trace ring buffer out, oldest command first.
+// A file name ending in .json gets the Chrome trace event format (for chrome://tracing or Perfetto),
+// with a row per command and a slice for each phase: parse, spawn (fork/spawn until exec) and run (exec until reaped).
+// Anything else (or stdout, if path is NULL) gets one JSON object per line.
+// Returns 0 on success, -1 if the file couldn't be written
+// referenced from https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+int trace_dump(const char* path){
+    FILE* stream = stdout;
+    size_t path_length = path ? strlen(path) : 0;
+    int chrome = path_length > 5 && strcmp(path + path_length - 5, ".json") == 0;
+    if (path && !(stream = fopen(path, "we"))){
+        fprintf(stderr, "smallsh: trace: ");
+        perror(path);
+        return -1;
+    }
+    if (chrome){
+        fprintf(stream, "{\"traceEvents\":[\n");
+    }
+
+    uint64_t first = trace_count > trace_capacity ? trace_count - trace_capacity : 0;
+    int first_event = 1;
+    for (uint64_t n = first; n < trace_count; n++){
+        struct trace_record* record = &trace_ring[n % trace_capacity];
+        if (!chrome){
+            fprintf(stream, "{\"seq\":%llu,\"pid\":%d,\"stages\":%d,\"command\":", (unsigned long long) record->seq, record->pid, record->stages);
+            json_string(stream, record->command);
+            fprintf(stream, ",\"parse\":%lld,\"spawn\":%lld,\"exec\":%lld,\"wait\":%lld,\"reap\":%lld",
+                    (long long) record->parse, (long long) record->spawn, (long long) record->exec,
+                    (long long) record->wait, (long long) record->reap);
+            if (record->exit_status == -1){
+                fprintf(stream, ",\"status\":null}\n");
+            }
+            else if (WIFEXITED(record->exit_status)){
+                fprintf(stream, ",\"status\":{\"exit\":%d}}\n", WEXITSTATUS(record->exit_status));
+            }
+            else{
+                fprintf(stream, ",\"status\":{\"signal\":%d}}\n", WTERMSIG(record->exit_status));
+            }
+            continue;
+        }
+
+        // one complete ("X") event per phase that both ends of are known, times in microseconds:
+        // parse until spawn, spawn until exec, exec until reap,
+        // plus an instant ("i") event for when the shell started waiting
+        // (a forked child can exec after that, so it isn't a phase boundary)
+        const char* phases[] = { "parse", "spawn", "run", "wait" };
+        int64_t starts[] = { record->parse, record->spawn, record->exec, record->wait };
+        int64_t ends[] = { record->spawn, record->exec, record->reap, record->wait };
+        for (int j = 0; j < 4; j++){
+            if (!starts[j] || !ends[j]){
+                continue;
+            }
+            fprintf(stream, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":%d,\"tid\":%llu,\"ts\":%.3f,",
+                    first_event ? "" : ",\n", phases[j], j < 3 ? "X" : "i", (int) getpid(), (unsigned long long) record->seq, starts[j] / 1e3);
+            if (j < 3){
+                fprintf(stream, "\"dur\":%.3f,", (ends[j] - starts[j]) / 1e3);
+            }
+            fprintf(stream, "\"args\":{\"command\":");
+            json_string(stream, record->command);
+            fprintf(stream, ",\"child\":%d,\"status\":%d}}", record->pid, record->exit_status);
+            first_event = 0;
+        }
+    }
+
+    if (chrome){
+        fprintf(stream, "\n]}\n");
+    }
+    if (stream != stdout){
+        return fclose(stream) == 0 ? 0 : -1;
+    }
+    fflush(stream);
+    return 0;
+}
+
+// implement trace:
+// "trace" says how many commands are in the ring buffer, "trace dump [file]" writes them out, see trace_dump()
+int trace_builtin(char** args){
+    if (!trace_ring){
+        fprintf(stderr, "smallsh: trace: tracing is off, set SMALLSH_TRACE to the number of commands to keep\n");
+        return 1;
+    }
+    if (args[1] && strcmp(args[1], "dump") == 0){
+        return trace_dump(args[2]) == 0 ? 0 : 1;
+    }
+    if (args[1]){
+        fprintf(stderr, "smallsh: trace: usage: trace [dump [file]]\n");
+        return 2;
+    }
+    uint64_t kept = trace_count < trace_capacity ? trace_count : trace_capacity;
+    printf("%llu commands traced, %llu kept (capacity %zu)\n", (unsigned long long) trace_count, (unsigned long long) kept, trace_capacity);
+    fflush(stdout);
+    return 0;
+}
+
+// add one process's rusage to a command's total,
+// times and context switches add up, the max RSS is the biggest of any one process
+void add_rusage(struct rusage* total, const struct rusage* usage){
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss){
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+// print the resources a command used, for time, status -v and -v "done" messages
+// referenced from https://man7.org/linux/man-pages/man2/getrusage.2.html
+void print_usage(FILE* stream, const struct usage* usage){
+    double real = (usage->end.tv_sec - usage->start.tv_sec) + (usage->end.tv_nsec - usage->start.tv_nsec) / 1e9;
+    fprintf(stream, "real %.3fs, user %ld.%03lds, sys %ld.%03lds, max rss %ld KB, context switches %ld voluntary %ld involuntary\n",
+            real,
+            (long) usage->rusage.ru_utime.tv_sec, (long) usage->rusage.ru_utime.tv_usec / 1000,
+            (long) usage->rusage.ru_stime.tv_sec, (long) usage->rusage.ru_stime.tv_usec / 1000,
+            usage->rusage.ru_maxrss, usage->rusage.ru_nvcsw, usage->rusage.ru_nivcsw);
+    fflush(stream);
+}
+
+// add a foreground command's exit status to the summary
+void record_status(int exit_status){
+    commands_run++;
+    if (WIFEXITED(exit_status)){
+        exit_counts[WEXITSTATUS(exit_status)]++;
+    }
+    else{
+        signal_counts[WTERMSIG(exit_status)]++;
+    }
+}
+
+// print how many foreground commands finished with each exit value/signal,
+// returns 0 if they all exited with 0, 1 otherwise, for the shell's own exit status
+int print_summary(void){
+    fprintf(stderr, "smallsh: %lu commands\n", commands_run);
+    for (int j = 0; j < 256; j++){
+        if (exit_counts[j]){
+            fprintf(stderr, "%8lu exit value %d\n", exit_counts[j], j);
+        }
+    }
+    for (int j = 1; j < NSIG; j++){
+        if (signal_counts[j]){
+            fprintf(stderr, "%8lu terminated by signal %d\n", signal_counts[j], j);
+        }
+    }
+    if (timeouts){
+        fprintf(stderr, "%8lu timed out\n", timeouts);
+    }
+    fflush(stderr);
+    return exit_counts[0] != commands_run;
+}
+
+// arm the timerfd for the earliest deadline, or disarm it if there are none left
+// referenced from https://man7.org/linux/man-pages/man2/timerfd_create.2.html
+void arm_timer(void){
+    int64_t next = deadline_count ? deadlines[0]->deadline : 0;
+    if (next == timer_armed){
+        return;
+    }
+    struct itimerspec when = {0};
+    when.it_value.tv_sec = next / 1000000000;
+    when.it_value.tv_nsec = next % 1000000000;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &when, NULL);
+    timer_armed = next;
+}
+
+// swap two entries of the deadline heap, keeping their heap_index up to date
+void deadline_swap(size_t a, size_t b){
+    struct job* job = deadlines[a];
+    deadlines[a] = deadlines[b];
+    deadlines[b] = job;
+    deadlines[a]->heap_index = a;
+    deadlines[b]->heap_index = b;
+}
+
+// move the entry at index up or down until the heap is in order again
+void deadline_fix(size_t index){
+    while (index && deadlines[index]->deadline < deadlines[(index - 1) / 2]->deadline){
+        deadline_swap(index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+    for(;;){
+        size_t smallest = index;
+        size_t left = 2 * index + 1;
+        size_t right = left + 1;
+        if (left < deadline_count && deadlines[left]->deadline < deadlines[smallest]->deadline){
+            smallest = left;
+        }
+        if (right < deadline_count && deadlines[right]->deadline < deadlines[smallest]->deadline){
+            smallest = right;
+        }
+        if (smallest == index){
+            break;
+        }
+        deadline_swap(index, smallest);
+        index = smallest;
+    }
+}
+
+// give a job a deadline, seconds from now
+void deadline_add(struct job* job, double seconds){
+    deadlines = grow(deadlines, &deadline_capacity, deadline_count + 1, sizeof(struct job*));
+    job->deadline = trace_now() + (int64_t) (seconds * 1e9);
+    job->heap_index = deadline_count;
+    deadlines[deadline_count++] = job;
+    deadline_fix(job->heap_index);
+    arm_timer();
+}
+
+// take a job's deadline away, e.g. because it finished in time
+void deadline_remove(struct job* job){
+    if (!job->deadline){
+        return;
+    }
+    size_t index = job->heap_index;
+    deadline_count--;
+    if (index != deadline_count){
+        deadline_swap(index, deadline_count);
+        deadline_fix(index);
+    }
+    job->deadline = 0;
+    arm_timer();
+}
+
+// send a signal to every process of a pipeline that's still running
+// a background or scheduled command gets it through its process group, so whatever it started itself gets it too.
+// That's only done while one of its stages hasn't been reaped, as until then the group id can't be reused
+void signal_job(struct job* leader, int sig){
+    int running = 0;
+    for (struct job* job = leader; job; job = job->next_member){
+        if (!job->reaped){
+            running = 1;
+            if (!leader->pgid){
+                kill(job->pid, sig);
+            }
+        }
+    }
+    if (running && leader->pgid){
+        killpg(leader->pgid, sig);
+    }
+}
+
+// called whenever timer_fd is readable: deal with every job whose deadline has passed.
+// The first time, the job gets SIGTERM and kill_grace more seconds to clean up,
+// the second time it gets SIGKILL, which it can't ignore
+void handle_deadlines(void){
+    uint64_t expirations;
+    read(timer_fd, &expirations, sizeof(expirations));
+    timer_armed = 0;
+
+    int64_t now = trace_now();
+    while (deadline_count && deadlines[0]->deadline <= now){
+        struct job* job = deadlines[0];
+        if (job->kill_stage == 0){
+            signal_job(job, SIGTERM);
+            job->kill_stage = 1;
+            job->deadline = now + (int64_t) (kill_grace * 1e9);
+            deadline_fix(0);
+        }
+        else{
+            signal_job(job, SIGKILL);
+            job->kill_stage = 2;
+            deadline_remove(job);
+        }
+    }
+    arm_timer();
+}
+
+// with -o, the output of a background command (the stdout of its last stage, and every stage's stderr),
+// which goes into a pipe instead of the terminal. The shell reads the pipe from the event loop as data comes in (see drain_spool()),
+// into a buffer of SPOOL_SIZE bytes. When that fills up it's appended to a temporary file (unlinked, so it goes away with us)
+// and starts over empty, so the output is the file's contents followed by the buffer's
+struct spool {
+    // read end of the pipe (O_NONBLOCK), -1 once every writer has closed it
+    int fd;
+    char* buffer;
+    size_t length;
+    // the temporary file, -1 until the buffer first fills up, and how much is in it
+    int spill_fd;
+    off_t spilled;
+};
+
+// the spools by their pipe's fd, so wait_for_event() can find the spool an event is for
+struct spool** spools_by_fd = NULL;
+size_t spools_capacity = 0;
+
+// start collecting output for a background command, returns the spool and puts the pipe's write end
+// (for the command's stdout/stderr) in *write_fd, or returns NULL if the pipe can't be made
+struct spool* spool_create(int* write_fd){
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1){
+        perror("smallsh: pipe");
+        return NULL;
+    }
+    struct spool* spool = malloc(sizeof(struct spool));
+    char* buffer = malloc(SPOOL_SIZE);
+    if (!spool || !buffer){
+        perror("smallsh: malloc");
+        exit(1);
+    }
+    *spool = (struct spool) { .fd = pipe_fds[0], .buffer = buffer, .spill_fd = -1 };
+    fcntl(spool->fd, F_SETFL, O_NONBLOCK);
+    spools_by_fd = grow(spools_by_fd, &spools_capacity, spool->fd + 1, sizeof(struct spool*));
+    spools_by_fd[spool->fd] = spool;
+    // read it whenever the shell waits, for input or for children
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = spool->fd };
+    epoll_ctl(events_fd, EPOLL_CTL_ADD, spool->fd, &event);
+    epoll_ctl(input_events_fd, EPOLL_CTL_ADD, spool->fd, &event);
+    *write_fd = pipe_fds[1];
+    return spool;
+}
+
+// stop reading a spool's pipe. Closing the fd isn't enough to take it out of the epoll sets:
+// that only happens once every copy of it is closed, and children that never exec (pump(), fan_out()) may still have one
+void spool_close(struct spool* spool){
+    if (spool->fd != -1){
+        spools_by_fd[spool->fd] = NULL;
+        epoll_ctl(events_fd, EPOLL_CTL_DEL, spool->fd, NULL);
+        epoll_ctl(input_events_fd, EPOLL_CTL_DEL, spool->fd, NULL);
+        close(spool->fd);
+        spool->fd = -1;
+    }
+}
+
+// append the buffer to the spill file (making it the first time), and empty the buffer
+// referenced from https://man7.org/linux/man-pages/man2/open.2.html (O_TMPFILE)
+void spool_spill(struct spool* spool){
+    if (spool->spill_fd == -1){
+        const char* directory = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+        spool->spill_fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (spool->spill_fd == -1){
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/smallsh-spool.XXXXXX", directory);
+            spool->spill_fd = mkostemp(path, O_CLOEXEC);
+            if (spool->spill_fd != -1){
+                unlink(path);
+            }
+        }
+        if (spool->spill_fd == -1){
+            // nowhere to put it, it's lost, but keep the command from blocking on a full pipe
+            perror("smallsh: output spool file");
+            spool->length = 0;
+            return;
+        }
+    }
+    for (size_t written = 0; written < spool->length; ){
+        ssize_t n = write(spool->spill_fd, spool->buffer + written, spool->length - written);
+        if (n == -1 && errno != EINTR){
+            perror("smallsh: output spool file");
+            break;
+        }
+        written += n > 0 ? n : 0;
+    }
+    spool->spilled += spool->length;
+    spool->length = 0;
+}
+
+// read everything that's in a spool's pipe right now, called when epoll says it's readable,
+// and before its output is shown so nothing that was already written gets left out
+void drain_spool(struct spool* spool){
+    while (spool->fd != -1){
+        if (spool->length == SPOOL_SIZE){
+            spool_spill(spool);
+        }
+        ssize_t n = read(spool->fd, spool->buffer + spool->length, SPOOL_SIZE - spool->length);
+        if (n > 0){
+            spool->length += n;
+        }
+        else if (n == 0){
+            // every writer is gone
+            spool_close(spool);
+        }
+        else if (errno != EINTR){
+            // EAGAIN: that's all for now
+            return;
+        }
+    }
+}
+
+// print what a spool has collected so far to stdout
+// referenced from https://man7.org/linux/man-pages/man2/sendfile.2.html
+void print_spool(struct spool* spool){
+    drain_spool(spool);
+    fflush(stdout);
+    for (off_t offset = 0; offset < spool->spilled; ){
+        if (sendfile(STDOUT_FILENO, spool->spill_fd, &offset, spool->spilled - offset) <= 0){
+            break;
+        }
+    }
+    for (size_t written = 0; written < spool->length; ){
+        ssize_t n = write(STDOUT_FILENO, spool->buffer + written, spool->length - written);
+        if (n <= 0){
+            break;
+        }
+        written += n;
+    }
+}
+
+// in a child process, close the fds the shell keeps for itself: the epoll sets, signalfd, timerfd, spool pipes,
+// and the script or connection commands are read from. They're all O_CLOEXEC, but pump() stages and fan_out()'s copier
+// never exec, and their copies would keep the spools' pipes (and a server's connection) open
+void close_shell_fds(void){
+    int fds[] = { events_fd, input_events_fd, sigchld_fd, timer_fd, input_fd != STDIN_FILENO ? input_fd : -1, serve_fd };
+    for (size_t j = 0; j < sizeof(fds) / sizeof(fds[0]); j++){
+        if (fds[j] > STDERR_FILENO){
+            close(fds[j]);
+        }
+    }
+    for (size_t fd = 0; fd < spools_capacity; fd++){
+        if (spools_by_fd[fd]){
+            close(fd);
+        }
+    }
+}
+
+void spool_free(struct spool* spool){
+    spool_close(spool);
+    if (spool->spill_fd != -1){
+        close(spool->spill_fd);
+    }
+    free(spool->buffer);
+    free(spool);
+}
+
+// free a pipeline's jobs, once it's done and reported
+void job_free(struct job* leader){
+    if (leader->spool){
+        spool_free(leader->spool);
+    }
+    while (leader){
+        struct job* next = leader->next_member;
+        free(leader);
+        leader = next;
+    }
+}
+
+// called whenever sigchld_fd is readable:
+// drain the pending SIGCHLD notifications, then reap every child that has exited.
+// Signals don't queue, so one notification can stand for several children,
+// that's why we loop on waitpid(-1, ..., WNOHANG) instead of trusting ssi_pid.
+// Foreground commands are in the job table too, so wait4(-1) can't take anything that isn't ours to take.
+// referenced from https://man7.org/linux/man-pages/man3/wait.3p.html
+void reap_children(void){
+    struct signalfd_siginfo info;
+    int notified = 0;
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info)){
+        // nothing to do with the contents, we just need it empty
+        notified = 1;
+    }
+    // no pending SIGCHLD means no child has exited since we last drained it
+    if (!notified){
+        return;
+    }
+
+    int exit_status;
+    struct rusage rusage;
+    pid_t terminatedChild;
+    int64_t wait_started = trace_ring ? trace_now() : 0;
+    while ((terminatedChild = wait4(-1, &exit_status, WNOHANG, &rusage)) > 0){
+        struct job* job = job_find(terminatedChild);
+        if (!job){
+            continue;
+        }
+        job->reaped = 1;
+
+        // add this process to its pipeline's totals, the last stage's exit status is the pipeline's.
+        // The leader stays in the table until the whole pipeline is done, even if it finishes first (e.g. "sleep 5 | true &"),
+        // its pid is the one that was printed, so jobs, wait and output still have to find it
+        struct job* leader = job->leader ? job->leader : job;
+        if (job != leader){
+            job_remove(job);
+        }
+        struct trace_record* trace = job_trace(leader);
+        if (trace && !trace->wait){
+            trace->wait = wait_started;
+        }
+        add_rusage(&leader->usage.rusage, &rusage);
+        if (job == leader){
+            leader->exit_status = exit_status;
+        }
+        if (--leader->stages_left){
+            continue;
+        }
+        job = leader;
+        job_remove(job);
+        clock_gettime(CLOCK_MONOTONIC, &job->usage.end);
+        deadline_remove(job);
+        if (job->kill_stage && !job->shutdown){
+            timeouts++;
+        }
+        if (trace){
+            trace->reap = (int64_t) job->usage.end.tv_sec * 1000000000 + job->usage.end.tv_nsec;
+            trace->exit_status = job->exit_status;
+        }
+        if (job->foreground){
+            continue;
+        }
+
+        // a scheduled foreground command frees up its slot, and counts as the last foreground command for status
+        if (job->scheduled){
+            running_scheduled_jobs--;
+            foreground_exit_status = job->exit_status;
+            foreground_timed_out = job->kill_stage != 0;
+            foreground_usage = job->usage;
+            record_status(job->exit_status);
+        }
+        // queue it up to be reported just before the next prompt
+        if (done_tail){
+            done_tail->next = job;
+        }
+        else{
+            done_head = job;
+        }
+        done_tail = job;
+    }
+}
+
+// wait for something to happen: children exiting (reaped right away), deadlines passing (handled right away),
+// or, if want_input is 1, input being ready to read, for at most timeout milliseconds (-1 for as long as it takes).
+// Returns 1 if there's input to read, 0 if something else happened (or nothing did in time), -1 if a signal (e.g. ^Z) interrupted the wait
+int wait_for_event(int want_input, int timeout){
+    if (want_input && !input_pollable){
+        return 1;
+    }
+    struct epoll_event events[16];
+    int count = epoll_wait(want_input ? input_events_fd : events_fd, events, 16, timeout);
+    if (count == -1){
+        if (errno == EINTR){
+            return -1;
+        }
+        perror("smallsh: epoll_wait");
+        exit(1);
+    }
+    int input_ready = 0;
+    for (int j = 0; j < count; j++){
+        if (events[j].data.fd == sigchld_fd){
+            reap_children();
+        }
+        else if (events[j].data.fd == timer_fd){
+            handle_deadlines();
+        }
+        else if (events[j].data.fd == input_fd){
+            input_ready = 1;
+        }
+        // background output coming in (with -o), the spool may have been freed since epoll_wait returned
+        else if (spools_by_fd[events[j].data.fd]){
+            drain_spool(spools_by_fd[events[j].data.fd]);
+        }
+    }
+    return input_ready;
+}
+
+// block until at least one child has exited (or a deadline passed), and reap it
+void wait_for_child(void){
+    wait_for_event(0, -1);
+}
+
+// implement wait: block until the given background processes have finished, or all of them if none are given
+// (they're still reported with the usual "Background pid is done" message)
+int wait_builtin(char** args){
+    if (!args[1]){
+        while (jobs.count){
+            wait_for_child();
+        }
+        return 0;
+    }
+    for (int j = 1; args[j]; j++){
+        char* end;
+        long pid = strtol(args[j], &end, 10);
+        if (*end || pid <= 0 || !job_find(pid)){
+            fprintf(stderr, "smallsh: wait: %s is not a background process\n", args[j]);
+            fflush(stderr);
+            continue;
+        }
+        while (job_find(pid)){
+            wait_for_child();
+        }
+    }
+    return 0;
+}
+
+// print a message for every background process that finished since the last prompt
+void report_done_jobs(void){
+    while (done_head){
+        struct job* job = done_head;
+        done_head = job->next;
+        if (job->quiet){
+            job_free(job);
+            continue;
+        }
+        printf("Background pid %d is done: ", job->pid);
+        if (job->kill_stage && !job->shutdown){
+            printf("timed out, ");
+        }
+        fflush(stdout);
+        // get exit info from WIFEXITED/WEXITSTATUS,
+        // this is basically identical to the "status" command below
+        // referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-process-api-monitoring-child-processes?module_item_id=22511469
+        if(WIFEXITED(job->exit_status)){
+            printf("exit value %d\n", WEXITSTATUS(job->exit_status));
+            fflush(stdout);
+        }
+        else{
+            printf("terminated by signal %d\n", WTERMSIG(job->exit_status));
+            fflush(stdout);
+        }
+        if (verbose_jobs || job->timed){
+            print_usage(stdout, &job->usage);
+        }
+        // with -o, its output comes right after
+        if (job->spool){
+            print_spool(job->spool);
+        }
+        job_free(job);
+    }
+    done_tail = NULL;
+}
+
+// find a background command by its pid (any stage's), whether it's still running or finished and not reported yet,
+// returns its leader or NULL
+struct job* find_background_job(pid_t pid){
+    struct job* job = job_find(pid);
+    if (job){
+        job = job->leader ? job->leader : job;
+        return job->foreground || job->quiet ? NULL : job;
+    }
+    for (job = done_head; job; job = job->next){
+        if (job->pid == pid && !job->quiet){
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// implement jobs: list the background commands, with how much output they've spooled so far (with -o)
+int jobs_builtin(char** args){
+    for (int done = 0; done < 2; done++){
+        for (struct job* job = done ? done_head : jobs.head; job; job = job->next){
+            if (job->leader || job->foreground || job->quiet){
+                continue;
+            }
+            printf("%d %s", job->pid, done ? "done" : "running");
+            if (job->spool){
+                drain_spool(job->spool);
+                printf(", %jd bytes of output", (intmax_t) (job->spool->spilled + job->spool->length));
+            }
+            printf("\n");
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
+
+// wait until every job has been reaped, or until (CLOCK_MONOTONIC nanoseconds) if that's not 0,
+// reporting them as they finish
+void wait_for_jobs(int64_t until){
+    while (jobs.count){
+        int64_t left = until ? until - trace_now() : -1;
+        if (until && left <= 0){
+            break;
+        }
+        wait_for_event(0, until ? (int) ((left + 999999) / 1000000) : -1);
+        report_done_jobs();
+    }
+}
+
+// implement exit: stop every command that's still running before the shell goes away,
+// so nothing is left running (or as a zombie) behind it, and report how each one ended.
+// By default they're terminated right away: each one gets SIGTERM (and SIGCONT, in case it was stopped),
+// through its process group for background commands so anything they started gets it too,
+// then kill_grace seconds (-k) before SIGKILL, through the same deadlines as timeouts (see handle_deadlines()).
+// "exit --drain SECS" lets them finish on their own for at most SECS seconds first (0 doesn't wait at all),
+// then terminates the rest, plain "exit --drain" waits as long as the grace period (-k).
+// Once terminating starts the wait is bounded: anything that's still around a second after SIGKILL is reported and left behind.
+// Returns -1 (and the shell keeps going) if the arguments are wrong
+int exit_jobs(char** args){
+    double drain = -1;
+    if (args[1] && strcmp(args[1], "--drain") == 0){
+        drain = kill_grace;
+        char* end;
+        if (args[2] && ((drain = strtod(args[2], &end)) < 0 || *end || end == args[2])){
+            drain = -2;
+        }
+    }
+    if ((args[1] && drain == -1) || drain == -2 || (args[1] && args[2] && args[3])){
+        fprintf(stderr, "smallsh: exit: usage: exit [--drain [seconds]]\n");
+        fflush(stderr);
+        return -1;
+    }
+    if (drain > 0){
+        wait_for_jobs(trace_now() + (int64_t) (drain * 1e9));
+    }
+
+    // every pipeline once, through its leader (which may already have been reaped, while other stages haven't)
+    for (struct job* job = jobs.head; job; job = job->next){
+        struct job* leader = job->leader ? job->leader : job;
+        if (leader->shutdown){
+            continue;
+        }
+        leader->shutdown = 1;
+        signal_job(leader, SIGTERM);
+        signal_job(leader, SIGCONT);
+        // one whose deadline already sent SIGTERM keeps its (kill_grace long) countdown to SIGKILL
+        if (!leader->kill_stage){
+            deadline_remove(leader);
+            leader->kill_stage = 1;
+            deadline_add(leader, kill_grace);
+        }
+    }
+    wait_for_jobs(trace_now() + (int64_t) ((kill_grace + 1) * 1e9));
+    for (struct job* job = jobs.head; job; job = job->next){
+        if (!job->reaped){
+            fprintf(stderr, "smallsh: pid %d didn't exit\n", job->pid);
+        }
+    }
+    fflush(stderr);
+    return 0;
+}
+
+// implement output: show what the given background commands have written so far (with -o)
+int output_builtin(char** args){
+    int result = 0;
+    for (int j = 1; args[j]; j++){
+        char* end;
+        long pid = strtol(args[j], &end, 10);
+        struct job* job = (*end || pid <= 0) ? NULL : find_background_job(pid);
+        if (!job || !job->spool){
+            fprintf(stderr, "smallsh: output: no output collected for %s\n", args[j]);
+            fflush(stderr);
+            result = 1;
+            continue;
+        }
+        print_spool(job->spool);
+    }
+    return result;
+}
+
+// read buffer for read_line(), holds the current line (plus whatever came in after it),
+// it starts out big enough for MAXINPUT characters and grows if a longer line comes along
+char* line_buffer = NULL;
+size_t line_capacity = 0;
+size_t line_start = 0;
+size_t line_end = 0;
+int input_eof = 0;
+
+// read commands from a file instead of stdin (-f).
+// A regular file is memory-mapped, and read_line() hands out lines straight from the mapping,
+// anything else (a pipe, /dev/stdin, ...) gets read in chunks like stdin
+// referenced from https://man7.org/linux/man-pages/man2/mmap.2.html
+void open_script(const char* path){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1){
+        fprintf(stderr, "smallsh: ");
+        perror(path);
+        exit(1);
+    }
+    if (!S_ISREG(info.st_mode) || info.st_size == 0){
+        input_fd = fd;
+        return;
+    }
+
+    // map one byte more than the file, so read_line() can null terminate a last line that has no newline.
+    // That byte comes from an anonymous mapping underneath the file, since touching a file mapping past the end of the file faults
+    size_t size = info.st_size;
+    char* script = mmap(NULL, size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (script == MAP_FAILED || mmap(script, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED){
+        perror("smallsh: mmap");
+        exit(1);
+    }
+    madvise(script, size, MADV_SEQUENTIAL);
+    close(fd);
+
+    // the whole file is already "read", read_line() never touches the fd or grows the buffer
+    line_buffer = script;
+    line_capacity = size + 1;
+    line_end = size;
+    input_eof = 1;
+}
+
+// read one line from the input (stdin, or the -f script), without the trailing newline, and put its length in *length.
+// While we wait for input we also watch sigchld_fd and timer_fd, so background processes get reaped right when they exit,
+// and deadlines get enforced on time.
+// Returns NULL at end of input, and an empty line if we were interrupted by a signal (e.g. ^Z at the prompt),
+// so the caller just goes back around to the prompt like it does for a blank line
+char* read_line(size_t* length){
+    static char empty_line[] = "";
+    *length = 0;
+    for(;;){
+        // hand out a complete line if we already have one buffered (there's no buffer at all before the first read)
+        char* newline = line_end > line_start ? memchr(line_buffer + line_start, '\n', line_end - line_start) : NULL;
+        if (newline){
+            char* line = line_buffer + line_start;
+            *newline = '\0';
+            *length = newline - line;
+            line_start = newline - line_buffer + 1;
+            return line;
+        }
+
+        // move the partial line to the front of the buffer to make room
+        if (line_start){
+            memmove(line_buffer, line_buffer + line_start, line_end - line_start);
+            line_end -= line_start;
+            line_start = 0;
+        }
+
+        // hand out a last line with no newline
+        if (input_eof && line_end){
+            line_buffer[line_end] = '\0';
+            *length = line_end;
+            line_start = line_end;
+            return line_buffer;
+        }
+        if (input_eof){
+            return NULL;
+        }
+
+        // keep room for at least MAXINPUT more characters plus the null terminator
+        line_buffer = grow(line_buffer, &line_capacity, line_end + MAXINPUT + 1, 1);
+
+        // wait for input, reaping children and handling deadlines in the meantime
+        int ready = wait_for_event(1, -1);
+        if (ready == -1){
+            return empty_line;
+        }
+        if (ready){
+            ssize_t n = read(input_fd, line_buffer + line_end, line_capacity - 1 - line_end);
+            if (n == -1){
+                if (errno == EINTR){
+                    return empty_line;
+                }
+                perror("smallsh: read");
+                exit(1);
+            }
+            if (n == 0){
+                input_eof = 1;
+            }
+            line_end += n;
+        }
+    }
+}
+
+// a command name remembered by the command hash, like bash's hash table,
+// so we only search PATH the first time a command is run
+struct hashed_command {
+    char* name;
+    char* path;
+    // how many times the cached path was used, shown by the hash built-in
+    unsigned long hits;
+    struct hashed_command* next;
+};
+
+// the command hash: a chained hash table keyed by command name, grows like the job table does
+struct command_hash {
+    struct hashed_command** buckets;
+    size_t bucket_count;
+    size_t count;
+    // the PATH the entries were found with, when PATH changes they're all forgotten
+    char* path_env;
+    // hit/miss counters, and how many access() calls the misses took, shown by the hash built-in
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long probes;
+};
+struct command_hash command_hash = {0};
+
+// FNV-1a hash of a command name
+size_t name_hash(const char* name){
+    size_t hash = 14695981039346656037u;
+    for (; *name; name++){
+        hash = (hash ^ (unsigned char) *name) * 1099511628211u;
+    }
+    return hash;
+}
+
+// forget every remembered command (hash -r, or PATH changed)
+void hash_clear(void){
+    for (size_t b = 0; b < command_hash.bucket_count; b++){
+        while (command_hash.buckets[b]){
+            struct hashed_command* entry = command_hash.buckets[b];
+            command_hash.buckets[b] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+    command_hash.count = 0;
+}
+
+// forget one remembered command, e.g. when its cached path doesn't exist anymore
+void hash_forget(const char* name){
+    if (!command_hash.count){
+        return;
+    }
+    struct hashed_command** link = &command_hash.buckets[name_hash(name) & (command_hash.bucket_count - 1)];
+    for (; *link; link = &(*link)->next){
+        if (strcmp((*link)->name, name) == 0){
+            struct hashed_command* entry = *link;
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            command_hash.count--;
+            return;
+        }
+    }
+}
+
+// remember that name lives at path
+struct hashed_command* hash_add(const char* name, const char* path){
+    if (command_hash.count >= command_hash.bucket_count){
+        size_t new_count = command_hash.bucket_count ? command_hash.bucket_count * 2 : 64;
+        struct hashed_command** new_buckets = calloc(new_count, sizeof(struct hashed_command*));
+        if (!new_buckets){
+            perror("smallsh: calloc");
+            exit(1);
+        }
+        for (size_t b = 0; b < command_hash.bucket_count; b++){
+            while (command_hash.buckets[b]){
+                struct hashed_command* entry = command_hash.buckets[b];
+                command_hash.buckets[b] = entry->next;
+                size_t nb = name_hash(entry->name) & (new_count - 1);
+                entry->next = new_buckets[nb];
+                new_buckets[nb] = entry;
+            }
+        }
+        free(command_hash.buckets);
+        command_hash.buckets = new_buckets;
+        command_hash.bucket_count = new_count;
+    }
+    struct hashed_command* entry = calloc(1, sizeof(struct hashed_command));
+    if (!entry || !(entry->name = strdup(name)) || !(entry->path = strdup(path))){
+        perror("smallsh: strdup");
+        exit(1);
+    }
+    size_t b = name_hash(name) & (command_hash.bucket_count - 1);
+    entry->next = command_hash.buckets[b];
+    command_hash.buckets[b] = entry;
+    command_hash.count++;
+    return entry;
+}
+
+// find the full path of a command, so it can be run with execv()/posix_spawn() instead of searching PATH every time.
+// Names with a / in them are used as they are, like execvp() does.
+// Otherwise we check the command hash, and on a miss search PATH the way execvp() would and remember the result
+// (only for absolute directories, a path relative to the current directory would go stale after cd).
+// Returns NULL if the command isn't anywhere in PATH
+// referenced from https://man7.org/linux/man-pages/man3/exec.3.html
+const char* hash_lookup(const char* name){
+    if (strchr(name, '/')){
+        return name;
+    }
+
+    // forget everything if PATH changed since we filled the hash
+    const char* path_env = getenv("PATH");
+    if (!path_env){
+        path_env = "/bin:/usr/bin";
+    }
+    if (!command_hash.path_env || strcmp(command_hash.path_env, path_env) != 0){
+        hash_clear();
+        free(command_hash.path_env);
+        command_hash.path_env = strdup(path_env);
+    }
+
+    if (command_hash.count){
+        for (struct hashed_command* entry = command_hash.buckets[name_hash(name) & (command_hash.bucket_count - 1)]; entry; entry = entry->next){
+            if (strcmp(entry->name, name) == 0){
+                entry->hits++;
+                command_hash.hits++;
+                return entry->path;
+            }
+        }
+    }
+
+    // search each directory in PATH, an empty entry means the current directory
+    command_hash.misses++;
+    static char* candidate = NULL;
+    static size_t candidate_capacity = 0;
+    size_t name_length = strlen(name);
+    for (const char* dir = path_env; ; ){
+        const char* end = strchrnul(dir, ':');
+        size_t dir_length = end - dir;
+        candidate = grow(candidate, &candidate_capacity, dir_length + name_length + 3, 1);
+        if (dir_length){
+            memcpy(candidate, dir, dir_length);
+        }
+        else{
+            candidate[0] = '.';
+            dir_length = 1;
+        }
+        candidate[dir_length] = '/';
+        memcpy(candidate + dir_length + 1, name, name_length + 1);
+
+        command_hash.probes++;
+        struct stat info;
+        if (access(candidate, X_OK) == 0 && stat(candidate, &info) == 0 && S_ISREG(info.st_mode)){
+            if (candidate[0] == '/'){
+                return hash_add(name, candidate)->path;
+            }
+            return candidate;
+        }
+        if (!*end){
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+// implement hash, like bash's:
+// "hash" lists the remembered commands and the hit/miss counters,
+// "hash -r" forgets everything, and "hash name..." looks the names up and remembers them
+int hash_builtin(char** args){
+    if (args[1] && strcmp(args[1], "-r") == 0){
+        hash_clear();
+        return 0;
+    }
+    if (args[1]){
+        int result = 0;
+        for (int j = 1; args[j]; j++){
+            if (!hash_lookup(args[j])){
+                fprintf(stderr, "smallsh: hash: %s: not found\n", args[j]);
+                fflush(stderr);
+                result = 1;
+            }
+        }
+        return result;
+    }
+
+    printf("hits\tcommand\n");
+    for (size_t b = 0; b < command_hash.bucket_count; b++){
+        for (struct hashed_command* entry = command_hash.buckets[b]; entry; entry = entry->next){
+            printf("%4lu\t%s\n", entry->hits, entry->path);
+        }
+    }
+    printf("%lu hits, %lu misses, %lu PATH lookups\n", command_hash.hits, command_hash.misses, command_hash.probes);
+    fflush(stdout);
+    return 0;
+}
+
+// one redirection of a stage, "< file", "2>> file", "2>&1" etc., see parse_redirection()
+struct redirection {
+    // the fd being redirected, e.g. 2 for "2> file"
+    int fd;
+    // open() flags for a file (O_RDONLY, or O_WRONLY | O_CREAT with O_TRUNC or O_APPEND), unused for "N>&M"
+    int flags;
+    // the file name, NULL for "N>&M"
+    char* file;
+    // M for "N>&M"
+    int source_fd;
+    // for "> a > b" fan-out, set up by fan_out() in the child: the pipe the command writes into (on the fd's first redirection),
+    // -2 on the others (fan_out()'s process writes those files, not the command), -1 otherwise
+    int pipe_fd;
+};
+
+// one stage of a pipeline, "cmd1 | cmd2 | ..." has one stage per command
+struct stage {
+    // null terminated arguments (a slice of command.args), args[0] is NULL for a stage
+    // made up of only redirections, which just copies its input to its output, see pump()
+    char** args;
+    // redirections in the order they were given (a slice of command.redirections), applied in that order
+    struct redirection* redirections;
+    int redirection_count;
+    // 0/1 for whether the same fd is redirected to more than one file ("> a > b"), which sends the output to all of them
+    int fanout;
+    // filled in by launch_pipeline(): where args[0] was found (NULL if it wasn't), and the pid of the process
+    const char* path;
+    pid_t pid;
+};
+
+// per-command settings from the prefixes at the start of a line (see parse_prefixes()) and the shell's options
+struct job_controls {
+    // 0/1 for whether it had a time prefix
+    int timed;
+    // deadline in seconds, 0 for none
+    double timeout;
+    // the rest are applied in the child right before exec, see apply_controls(),
+    // posix_spawn can't do any of them so a command that has any of them set is forked
+    int has_cpus;
+    cpu_set_t cpus;
+    int has_nice;
+    int nice;
+    int limit_count;
+    int limit_resources[8];
+    struct rlimit limits[8];
+};
+
+// names for the limit prefix, e.g. "limit mem=2G cpu=60"
+// sizes take K/M/G/T suffixes, cpu is in seconds, the rest are counts
+// referenced from https://man7.org/linux/man-pages/man2/setrlimit.2.html
+const struct {
+    const char* name;
+    int resource;
+    int is_size;
+} limit_names[] = {
+    { "mem", RLIMIT_AS, 1 },
+    { "cpu", RLIMIT_CPU, 0 },
+    { "fsize", RLIMIT_FSIZE, 1 },
+    { "stack", RLIMIT_STACK, 1 },
+    { "core", RLIMIT_CORE, 1 },
+    { "nofile", RLIMIT_NOFILE, 0 },
+    { "nproc", RLIMIT_NPROC, 0 },
+};
+
+// 0/1 for whether background commands get spread over the CPUs, one CPU each in turn, set by the -r option.
+// shell_cpus is the set of CPUs the shell may use, next_cpu is the one the next background command gets
+int round_robin = 0;
+cpu_set_t shell_cpus;
+int next_cpu = 0;
+
+// parse a CPU list like "2-5" or "0,2,8-11" into set, returns -1 if it isn't one
+int parse_cpus(const char* list, cpu_set_t* set){
+    CPU_ZERO(set);
+    for (const char* p = list; ; ){
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0){
+            return -1;
+        }
+        if (*end == '-'){
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first){
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE){
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++){
+            CPU_SET(cpu, set);
+        }
+        if (*end == ','){
+            p = end + 1;
+            continue;
+        }
+        return *end ? -1 : 0;
+    }
+}
+
+// parse one "name=value" word of a limit prefix into controls, returns -1 if it isn't one
+int parse_limit(const char* setting, struct job_controls* controls){
+    const char* equals = strchr(setting, '=');
+    if (!equals || controls->limit_count == 8){
+        return -1;
+    }
+    for (size_t j = 0; j < sizeof(limit_names) / sizeof(limit_names[0]); j++){
+        if (strlen(limit_names[j].name) != (size_t) (equals - setting) || strncmp(setting, limit_names[j].name, equals - setting) != 0){
+            continue;
+        }
+        // digits only, strtoull would take "-1" as ULLONG_MAX
+        char* end;
+        errno = 0;
+        unsigned long long value = strtoull(equals + 1, &end, 10);
+        if (end == equals + 1 || !isdigit((unsigned char) equals[1]) || errno == ERANGE){
+            return -1;
+        }
+        if (limit_names[j].is_size && *end){
+            const char* suffixes = "KMGT";
+            const char* suffix = strchr(suffixes, *end);
+            if (!suffix || end[1]){
+                return -1;
+            }
+            int shift = 10 * (suffix - suffixes + 1);
+            // don't let a huge size wrap around to a small limit
+            if (value > (ULLONG_MAX >> shift)){
+                return -1;
+            }
+            value <<= shift;
+        }
+        else if (*end){
+            return -1;
+        }
+        controls->limit_resources[controls->limit_count] = limit_names[j].resource;
+        controls->limits[controls->limit_count].rlim_cur = value;
+        controls->limits[controls->limit_count].rlim_max = value;
+        controls->limit_count++;
+        return 0;
+    }
+    return -1;
+}
+
+// take the prefixes off the start of the first stage's arguments and put them in controls, in any order:
+// "time": run the rest of the line as usual, then print the resources it used
+// "timeout SECS": give the command a deadline (instead of the -t one), 0 means no deadline
+// "cpus LIST": only let the command run on these CPUs, e.g. "cpus 2-5"
+// "nice N" or "nice -n N": run the command N nice levels lower (higher with "-n -N", if we're allowed to)
+// "limit NAME=VALUE...": resource limits for the command, e.g. "limit mem=2G cpu=60", see limit_names
+// Returns 0 on success, prints a message and returns -1 if a limit is malformed or there's no command after the prefixes
+// (there's no limit program to leave it to, unlike timeout and nice)
+int parse_prefixes(struct stage* stage, struct job_controls* controls){
+    memset(controls, 0, sizeof(*controls));
+    controls->timeout = default_timeout;
+    char** start = stage->args;
+    for(;;){
+        char** args = stage->args;
+        // prefixes with no command after them, e.g. a bare "time", are an error rather than an empty command
+        if (!args[0]){
+            if (args != start){
+                fprintf(stderr, "smallsh: %s: missing command\n", start[0]);
+                fflush(stderr);
+                return -1;
+            }
+            return 0;
+        }
+        if (strcmp(args[0], "time") == 0){
+            controls->timed = 1;
+            stage->args++;
+            continue;
+        }
+        if (strcmp(args[0], "limit") == 0){
+            int j = 1;
+            while (args[j] && strchr(args[j], '=')){
+                if (parse_limit(args[j], controls) == -1){
+                    fprintf(stderr, "smallsh: limit: bad limit %s\n", args[j]);
+                    fflush(stderr);
+                    return -1;
+                }
+                j++;
+            }
+            stage->args += j;
+            continue;
+        }
+        if (strcmp(args[0], "timeout") != 0 && strcmp(args[0], "cpus") != 0 && strcmp(args[0], "nice") != 0){
+            return 0;
+        }
+
+        // the rest take one value ("nice -n N" works too, like nice(1)). When it's missing or isn't one we understand,
+        // e.g. "timeout 2s" or "nice -5" (which means +5 to nice(1)), the words are left alone
+        // so the real timeout/nice program runs instead
+        const char* value = args[1];
+        int words = 2;
+        if (strcmp(args[0], "nice") == 0 && value && strcmp(value, "-n") == 0){
+            value = args[2];
+            words = 3;
+        }
+        if (!value){
+            return 0;
+        }
+        char* end;
+        if (strcmp(args[0], "timeout") == 0){
+            double timeout = strtod(value, &end);
+            if (*end || end == value || !(timeout >= 0)){
+                return 0;
+            }
+            controls->timeout = timeout;
+        }
+        else if (strcmp(args[0], "cpus") == 0){
+            cpu_set_t cpus;
+            if (parse_cpus(value, &cpus) == -1){
+                return 0;
+            }
+            controls->cpus = cpus;
+            controls->has_cpus = 1;
+        }
+        else{
+            if (words == 2 && value[0] == '-'){
+                return 0;
+            }
+            errno = 0;
+            long adjustment = strtol(value, &end, 10);
+            if (*end || end == value || errno || adjustment < INT_MIN || adjustment > INT_MAX){
+                return 0;
+            }
+            controls->nice = adjustment;
+            controls->has_nice = 1;
+        }
+        stage->args += words;
+    }
+}
+
+// 0/1 for whether a command's controls have to be applied in a forked child
+int needs_fork(const struct job_controls* controls){
+    return controls->has_cpus || controls->has_nice || controls->limit_count;
+}
+
+// apply the CPU affinity, nice level and resource limits to the current process, in the child right before exec,
+// so they're inherited by the program (and anything it starts). Exits with 1 if one can't be applied,
+// like a redirection that can't be opened
+// referenced from https://man7.org/linux/man-pages/man2/sched_setaffinity.2.html
+// and https://man7.org/linux/man-pages/man2/nice.2.html
+void apply_controls(const struct job_controls* controls){
+    if (controls->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &controls->cpus) == -1){
+        perror("smallsh: cpus");
+        exit(1);
+    }
+    if (controls->has_nice){
+        errno = 0;
+        if (nice(controls->nice) == -1 && errno){
+            perror("smallsh: nice");
+            exit(1);
+        }
+    }
+    for (int j = 0; j < controls->limit_count; j++){
+        if (setrlimit(controls->limit_resources[j], &controls->limits[j]) == -1){
+            perror("smallsh: limit");
+            exit(1);
+        }
+    }
+}
+
+// everything parse_line() produces for one command line.
+// The arrays are reused from line to line and only ever grow,
+// so once they are big enough for the longest line seen so far, parsing does no heap allocations at all
+struct command {
+    // the words of the line, after quote removal and $$ expansion, each null terminated
+    char* arena;
+    size_t arena_capacity;
+    // arguments for every stage, each stage's arguments are followed by a NULL
+    char** args;
+    size_t args_capacity;
+    struct stage* stages;
+    size_t stages_capacity;
+    int stage_count;
+    struct redirection* redirections;
+    size_t redirections_capacity;
+    // 0/1 for whether the line ended with &
+    int background;
+};
+struct command command = {0};
+
+// the shell's pid as a string, for expanding $$, formatted once at startup
+// snprintf usage referenced from https://edstem.org/us/courses/29177/discussion/2053610
+char pid_string[24];
+size_t pid_length;
+
+// check whether word is a redirection operator, and if so fill in redirection and return 1:
+// "<" and "N<" read a file, ">"/"N>" write one (truncating it), ">>"/"N>>" append to one, N defaulting to 0 for < and 1 for >,
+// and "N>&M"/"N<&M" make fd N a copy of fd M (e.g. "2>&1"), the only one that doesn't take a file name.
+// Returns 0 for anything else, e.g. ">&" or "2>x"
+int parse_redirection(const char* word, struct redirection* redirection){
+    const char* p = word;
+    long fd = -1;
+    if (isdigit((unsigned char) *p)){
+        fd = strtol(word, (char**) &p, 10);
+        // bigger than any fd could be
+        if (fd > 65535){
+            return 0;
+        }
+    }
+    if (*p == '<'){
+        redirection->flags = O_RDONLY;
+        p++;
+    }
+    else if (*p == '>' && p[1] == '>'){
+        redirection->flags = O_WRONLY | O_CREAT | O_APPEND;
+        p += 2;
+    }
+    else if (*p == '>'){
+        redirection->flags = O_WRONLY | O_CREAT | O_TRUNC;
+        p++;
+    }
+    else{
+        return 0;
+    }
+    redirection->fd = fd != -1 ? fd : (redirection->flags == O_RDONLY ? 0 : 1);
+    redirection->file = NULL;
+    redirection->source_fd = -1;
+    redirection->pipe_fd = -1;
+    if (!*p){
+        return 1;
+    }
+
+    // "N>&M", but not "N>>&M"
+    if (*p == '&' && isdigit((unsigned char) p[1]) && !(redirection->flags & O_APPEND)){
+        char* end;
+        long source_fd = strtol(p + 1, &end, 10);
+        if (!*end && source_fd <= 65535){
+            redirection->source_fd = source_fd;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// break up a command line into the stages of a pipeline, in a single pass over the line:
+// words are separated by spaces/tabs, $$ expands to the shell's pid anywhere in a word (any number of times),
+// '...' quotes everything literally, "..." quotes everything but $$, and \ escapes the next character
+// (inside "..." only \", \\ and \$ are escapes).
+// Redirections (see parse_redirection()), | and a final & are only operators when they are a whole word and not quoted,
+// like the original tokenizer, so "a>b" and '&' are plain arguments.
+// Words are written into cmd->arena and the args/stages point into it, they stay valid until the next call.
+// Returns 0 on success, prints a message and returns -1 on a syntax error
+int parse_line(const char* line, size_t length, struct command* cmd){
+    // size everything for the worst case up front so nothing moves while we parse:
+    // every input character turns into at most one output character plus a terminator,
+    // except $$, which turns two characters into pid_length.
+    // There can't be more words or stages than characters
+    cmd->arena = grow(cmd->arena, &cmd->arena_capacity, length * (pid_length / 2 + 2) + 1, 1);
+    cmd->args = grow(cmd->args, &cmd->args_capacity, length + 2, sizeof(char*));
+    cmd->stages = grow(cmd->stages, &cmd->stages_capacity, length + 1, sizeof(struct stage));
+    cmd->redirections = grow(cmd->redirections, &cmd->redirections_capacity, length + 1, sizeof(struct redirection));
+
+    char* out = cmd->arena;
+    char** args = cmd->args;
+    size_t arg_count = 0;
+    cmd->stage_count = 1;
+    size_t redirection_count = 0;
+    cmd->stages[0] = (struct stage) { .args = args, .redirections = cmd->redirections };
+    cmd->background = 0;
+    // the redirection still waiting for its file name (and its operator, for the error message), if any
+    struct redirection* pending = NULL;
+    const char* pending_operator = NULL;
+    // where the last unquoted & went in args, so we can tell if it ended the line
+    size_t ampersand = (size_t) -1;
+
+    const char* p = line;
+    for(;;){
+        while (*p == ' ' || *p == '\t'){
+            p++;
+        }
+        if (!*p){
+            break;
+        }
+
+        // copy one word into the arena
+        char* word = out;
+        char quote = 0;
+        int quoted = 0;
+        while (*p && (quote || (*p != ' ' && *p != '\t'))){
+            char c = *p++;
+            if (quote == '\''){
+                if (c == '\''){
+                    quote = 0;
+                }
+                else{
+                    *out++ = c;
+                }
+            }
+            else if (c == '"' || (c == '\'' && !quote)){
+                quote = quote ? 0 : c;
+                quoted = 1;
+            }
+            else if (c == '\\' && *p && (!quote || *p == '"' || *p == '\\' || *p == '$')){
+                *out++ = *p++;
+                quoted = 1;
+            }
+            else if (c == '$' && *p == '$'){
+                memcpy(out, pid_string, pid_length);
+                out += pid_length;
+                p++;
+            }
+            else{
+                *out++ = c;
+            }
+        }
+        *out++ = '\0';
+        if (quote){
+            fprintf(stderr, "smallsh: unterminated %c quote\n", quote);
+            fflush(stderr);
+            return -1;
+        }
+
+        struct stage* stage = &cmd->stages[cmd->stage_count-1];
+        if (pending){
+            pending->file = word;
+            pending = NULL;
+            continue;
+        }
+        if (!quoted){
+            // check for a redirection, the next word is the file name (unless it's "N>&M")
+            struct redirection* redirection = &cmd->redirections[redirection_count];
+            if (parse_redirection(word, redirection)){
+                // the same fd written to more than one file fans out
+                for (int j = 0; redirection->source_fd == -1 && redirection->flags != O_RDONLY && j < stage->redirection_count; j++){
+                    struct redirection* earlier = &stage->redirections[j];
+                    if (earlier->fd == redirection->fd && earlier->source_fd == -1 && earlier->flags != O_RDONLY){
+                        stage->fanout = 1;
+                    }
+                }
+                redirection_count++;
+                stage->redirection_count++;
+                if (redirection->source_fd == -1){
+                    pending = redirection;
+                    pending_operator = word;
+                }
+                continue;
+            }
+            // check for a pipe, which starts the next stage
+            // (leave a NULL in args to terminate this stage's arguments)
+            else if (strcmp(word, "|") == 0){
+                args[arg_count++] = NULL;
+                cmd->stages[cmd->stage_count++] = (struct stage) { .args = &args[arg_count], .redirections = &cmd->redirections[redirection_count] };
+                continue;
+            }
+            else if (strcmp(word, "&") == 0){
+                ampersand = arg_count;
+            }
+        }
+        // otherwise put it in the argument array
+        args[arg_count++] = word;
+    }
+    args[arg_count] = NULL;
+
+    if (pending){
+        fprintf(stderr, "smallsh: missing file name after %s\n", pending_operator);
+        fflush(stderr);
+        return -1;
+    }
+
+    // check for background process flag "&" at the very end of the line
+    if (arg_count && ampersand == arg_count-1){
+        cmd->background = 1;
+        // clear extra argument
+        args[arg_count-1] = NULL;
+    }
+    return 0;
+}
+
+// open a redirection's file (O_CLOEXEC, the command gets it through dup2), returns the fd,
+// or prints a message and returns -1 if it can't be opened
+int open_redirection(const struct redirection* redirection){
+    int fd = open(redirection->file, redirection->flags | O_CLOEXEC, 0644);
+    if (fd == -1){
+        if (redirection->flags == O_RDONLY){
+            fprintf(stderr, "smallsh: ");
+            fflush(stderr);
+            perror(redirection->file);
+        }
+        else{
+            printf("[output file open failed]\n");
+            fflush(stdout);
+        }
+    }
+    return fd;
+}
+
+// open (and create) the files of a line made up of nothing but redirections, in the shell itself
+// returns 0 on success, prints a message and returns -1 on failure
+// referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-processes-and-i-slash-o?module_item_id=22511479
+int open_stage_files(struct stage* stage){
+    for (int j = 0; j < stage->redirection_count; j++){
+        if (stage->redirections[j].file){
+            int fd = open_redirection(&stage->redirections[j]);
+            if (fd == -1){
+                return -1;
+            }
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+// apply a stage's redirections to the current process, in order like sh does,
+// so "> f 2>&1" sends stdout and stderr to f, and "2>&1 > f" sends stderr to where stdout was before.
+// In the child process saved is NULL. Built ins run in the shell itself, so they pass an array with one entry per redirection,
+// all -2 to start with, and get the fds they replace saved there (-1 if it wasn't open), see restore_redirections().
+// Every fd opened here is O_CLOEXEC, and closed again once it has been dup2'd into place.
+// Returns 0, or prints a message and returns the exit value the command gets: 1 if a file can't be opened, 2 if dup2 fails
+int apply_redirections(struct stage* stage, int* saved){
+    for (int j = 0; j < stage->redirection_count; j++){
+        struct redirection* redirection = &stage->redirections[j];
+        // "> a > b" targets after the first are written by fan_out()'s process, not the command
+        if (redirection->pipe_fd == -2){
+            continue;
+        }
+        if (saved){
+            saved[j] = fcntl(redirection->fd, F_DUPFD_CLOEXEC, 10);
+        }
+
+        int fd = redirection->source_fd;
+        if (redirection->pipe_fd != -1){
+            fd = redirection->pipe_fd;
+        }
+        else if (redirection->file && (fd = open_redirection(redirection)) == -1){
+            return 1;
+        }
+
+        // open() can hand out the very fd being redirected, then it only has to stay open across exec
+        if (fd == redirection->fd){
+            if (fcntl(fd, F_SETFD, 0) == -1){
+                fprintf(stderr, "smallsh: %d: ", fd);
+                fflush(stderr);
+                perror(NULL);
+                return 1;
+            }
+            continue;
+        }
+        if (dup2(fd, redirection->fd) == -1){
+            // a copy of an fd that isn't open
+            if (redirection->source_fd != -1){
+                fprintf(stderr, "smallsh: %d: ", fd);
+                fflush(stderr);
+                perror(NULL);
+                return 1;
+            }
+            printf(redirection->flags == O_RDONLY ? "[input file redirection failed]\n" : "[output file redirection failed]\n");
+            fflush(stdout);
+            close(fd);
+            return 2;
+        }
+        if (redirection->source_fd == -1){
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+// undo apply_redirections() for a built in, last redirection first, so every fd ends up the way it was.
+// Everything the shell opens itself is O_CLOEXEC, only stdin/stdout/stderr aren't,
+// so that's what a restored fd gets back (plain dup2() would leave e.g. sigchld_fd open across exec)
+void restore_redirections(struct stage* stage, int* saved){
+    for (int j = stage->redirection_count - 1; j >= 0; j--){
+        int fd = stage->redirections[j].fd;
+        if (saved[j] == -1){
+            close(fd);
+        }
+        else if (saved[j] != -2){
+            dup3(saved[j], fd, fd > 2 ? O_CLOEXEC : 0);
+            close(saved[j]);
+        }
+    }
+}
+
+// copy everything from in_fd to out_fd until end of file,
+// this is what a pipeline stage with no command (e.g. "< file | filter > out") runs.
+// In splice mode (-s) the data is moved with splice(2), so it goes straight from the page cache into the pipe
+// (or back out of it) without ever being copied through a userspace buffer.
+// splice needs a pipe on at least one end, so plain file to file copies always use the read/write loop
+// referenced from https://man7.org/linux/man-pages/man2/splice.2.html
+int pump(int in_fd, int out_fd){
+    if (splice_mode){
+        for(;;){
+            ssize_t n = splice(in_fd, NULL, out_fd, NULL, PUMP_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n == 0){
+                return 0;
+            }
+            if (n == -1){
+                if (errno == EINTR){
+                    continue;
+                }
+                // neither end is a pipe, use the read/write loop below
+                if (errno == EINVAL){
+                    break;
+                }
+                return -1;
+            }
+        }
+    }
+
+    static char buffer[PUMP_CHUNK];
+    for(;;){
+        ssize_t n = read(in_fd, buffer, PUMP_CHUNK);
+        if (n == 0){
+            return 0;
+        }
+        if (n == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        for (ssize_t written = 0; written < n; ){
+            ssize_t w = write(out_fd, buffer + written, n - written);
+            if (w == -1){
+                if (errno == EINTR){
+                    continue;
+                }
+                return -1;
+            }
+            written += w;
+        }
+    }
+}
+
+// with "> a > b" fan-out, the process running the command, so fan_out()'s process can pass signals on to it
+pid_t fanout_command = 0;
+
+// signal handler in fan_out()'s process: a deadline's SIGTERM (or a SIGHUP/SIGQUIT) is meant for the command
+void forward_signal(int signo){
+    kill(fanout_command, signo);
+}
+
+// move n bytes out of the pipe in_fd into out_fd with splice(2), so they never get copied through userspace,
+// except for files splice refuses (it won't write to O_APPEND ones), which get a read/write loop.
+// out_fd -1 (a target that failed) just drops the bytes. Either way exactly n bytes leave the pipe.
+// Returns 0, or -1 if writing to out_fd failed part way (the rest of the n bytes are dropped)
+int splice_all(int in_fd, int out_fd, size_t n){
+    static char buffer[65536];
+    int result = 0;
+    while (n){
+        ssize_t moved = -1;
+        if (out_fd != -1){
+            moved = splice(in_fd, NULL, out_fd, NULL, n, SPLICE_F_MOVE);
+            if (moved == -1 && errno == EINTR){
+                continue;
+            }
+        }
+        if (moved == -1 && out_fd != -1 && errno == EINVAL){
+            moved = read(in_fd, buffer, n < sizeof(buffer) ? n : sizeof(buffer));
+            for (ssize_t written = 0; moved > 0 && written < moved; ){
+                ssize_t w = write(out_fd, buffer + written, moved - written);
+                if (w == -1 && errno != EINTR){
+                    out_fd = -1;
+                    result = -1;
+                    break;
+                }
+                written += w > 0 ? w : 0;
+            }
+        }
+        else if (moved == -1){
+            if (out_fd != -1){
+                result = -1;
+                out_fd = -1;
+            }
+            moved = read(in_fd, buffer, n < sizeof(buffer) ? n : sizeof(buffer));
+        }
+        if (moved <= 0){
+            return -1;
+        }
+        n -= moved;
+    }
+    return result;
+}
+
+// set up "> a > b" fan-out in a stage's child process: every fd that is redirected to more than one file
+// gets a pipe instead, and the command is forked off to run with those pipes as its fds (this returns in that process).
+// This process stays behind and copies everything written into each pipe to all of that fd's files with tee(2)/splice(2),
+// so the data is never copied through userspace: tee() duplicates the pipe's pages into a scratch pipe, which is spliced
+// into one file, once per file but the last, which gets the original pages spliced straight out of the pipe.
+// Once the command (and anything that inherited the pipes) is done it exits with the command's exit status,
+// so the job table and its wait4() accounting see the command finish only after its output is all written.
+// referenced from https://man7.org/linux/man-pages/man2/tee.2.html
+void fan_out(struct stage* stage){
+    int count = stage->redirection_count;
+    struct redirection* redirections = stage->redirections;
+    // for every output file redirection, the index of the first one for the same fd, -1 for the rest
+    int* first = malloc(count * sizeof(int));
+    // the files' fds, and for the first redirection of a fan-out fd, the read end of its pipe
+    int* targets = malloc(count * sizeof(int));
+    int* pipe_in = malloc(count * sizeof(int));
+    struct pollfd* polled = malloc(count * sizeof(struct pollfd));
+    if (!first || !targets || !pipe_in || !polled){
+        perror("smallsh: malloc");
+        exit(1);
+    }
+    for (int j = 0; j < count; j++){
+        first[j] = -1;
+        targets[j] = -1;
+        pipe_in[j] = -1;
+        if (!redirections[j].file || redirections[j].flags == O_RDONLY){
+            continue;
+        }
+        first[j] = j;
+        for (int i = 0; i < j; i++){
+            if (first[i] == i && redirections[i].fd == redirections[j].fd){
+                first[j] = i;
+                break;
+            }
+        }
+    }
+
+    // open the files (so a bad one fails before the command runs), and make a pipe for each fan-out fd
+    for (int j = 0; j < count; j++){
+        if (first[j] == -1){
+            continue;
+        }
+        int fans_out = first[j] != j;
+        for (int k = j + 1; !fans_out && k < count; k++){
+            fans_out = first[k] == j;
+        }
+        if (!fans_out){
+            first[j] = -1;
+            continue;
+        }
+        if ((targets[j] = open_redirection(&redirections[j])) == -1){
+            exit(1);
+        }
+        if (first[j] != j){
+            redirections[j].pipe_fd = -2;
+            continue;
+        }
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) == -1){
+            perror("smallsh: pipe");
+            exit(2);
+        }
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, PUMP_CHUNK);
+        redirections[j].pipe_fd = pipe_fds[1];
+        pipe_in[j] = pipe_fds[0];
+    }
+    int scratch[2];
+    if (pipe2(scratch, O_CLOEXEC) == -1){
+        perror("smallsh: pipe");
+        exit(2);
+    }
+    fcntl(scratch[1], F_SETPIPE_SZ, PUMP_CHUNK);
+
+    pid_t copier = getpid();
+    fanout_command = fork();
+    if (fanout_command == -1){
+        perror("smallsh: fork");
+        exit(2);
+    }
+    if (fanout_command == 0){
+        // the command: it only needs the pipes' write ends, which apply_redirections() puts in place.
+        // If the copier gets SIGKILLed (a deadline's second try), take the command down with it
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != copier){
+            exit(1);
+        }
+        for (int j = 0; j < count; j++){
+            if (targets[j] != -1){
+                close(targets[j]);
+            }
+            if (pipe_in[j] != -1){
+                close(pipe_in[j]);
+            }
+        }
+        close(scratch[0]);
+        close(scratch[1]);
+        free(first);
+        free(targets);
+        free(pipe_in);
+        free(polled);
+        return;
+    }
+
+    // the copier: pass a deadline's SIGTERM on to the command, ^C reaches the command from the terminal by itself
+    struct sigaction forward = {0};
+    forward.sa_handler = forward_signal;
+    sigfillset(&forward.sa_mask);
+    sigaction(SIGTERM, &forward, NULL);
+    sigaction(SIGHUP, &forward, NULL);
+    sigaction(SIGQUIT, &forward, NULL);
+    signal(SIGINT, SIG_IGN);
+    int open_pipes = 0;
+    for (int j = 0; j < count; j++){
+        if (redirections[j].pipe_fd >= 0){
+            close(redirections[j].pipe_fd);
+            open_pipes++;
+        }
+    }
+
+    while (open_pipes){
+        int polled_count = 0;
+        for (int j = 0; j < count; j++){
+            if (pipe_in[j] != -1){
+                polled[polled_count++] = (struct pollfd) { .fd = pipe_in[j], .events = POLLIN };
+            }
+        }
+        if (poll(polled, polled_count, -1) == -1){
+            continue;
+        }
+        for (int p = 0; p < polled_count; p++){
+            if (!polled[p].revents){
+                continue;
+            }
+            int j = 0;
+            while (pipe_in[j] != polled[p].fd){
+                j++;
+            }
+            ssize_t n = tee(pipe_in[j], scratch[1], PUMP_CHUNK, 0);
+            if (n == -1 && errno == EINTR){
+                continue;
+            }
+            // end of file, the command is done writing to this fd
+            if (n <= 0){
+                close(pipe_in[j]);
+                pipe_in[j] = -1;
+                open_pipes--;
+                continue;
+            }
+            int last = j;
+            for (int k = j + 1; k < count; k++){
+                if (first[k] == j){
+                    last = k;
+                }
+            }
+            // the scratch pipe is empty again after each file, so the next tee() gets the same n bytes from the front of the pipe
+            for (int k = j; k < count; k++){
+                if (first[k] != j){
+                    continue;
+                }
+                if (k != j && k != last){
+                    while (tee(pipe_in[j], scratch[1], n, 0) == -1 && errno == EINTR){
+                    }
+                }
+                // a file that can't be written to anymore (e.g. a full disk) gets dropped, the rest carry on
+                int failed = k == last ? splice_all(pipe_in[j], targets[k], n) : splice_all(scratch[0], targets[k], n);
+                if (failed && targets[k] != -1){
+                    fprintf(stderr, "smallsh: ");
+                    perror(redirections[k].file);
+                    close(targets[k]);
+                    targets[k] = -1;
+                }
+            }
+        }
+    }
+
+    // finish the way the command did
+    int exit_status;
+    while (waitpid(fanout_command, &exit_status, 0) == -1){
+        if (errno != EINTR){
+            exit(2);
+        }
+    }
+    if (WIFSIGNALED(exit_status)){
+        signal(WTERMSIG(exit_status), SIG_DFL);
+        raise(WTERMSIG(exit_status));
+    }
+    exit(WEXITSTATUS(exit_status));
+}
+
+// Child process runs this code, after fork() in launch_pipeline()
+// (with "-l fork", for stages with no command, commands with cpus/nice/limit controls, and whenever spawn_stage() fails)
+// in_fd/out_fd are the pipe ends to read/write, or -1 for the shell's own stdin/stdout,
+// and err_fd is where stderr goes (the output spool, with -o), or -1 for the shell's stderr
+// background (and -j scheduled) commands join process group pgid (0 to start a new one), -1 stays in the shell's,
+// last_stage is set for the pipeline's last stage, the only one whose exec goes in the trace
+void run_stage(struct stage* stage, int in_fd, int out_fd, int err_fd, int background, pid_t pgid, const struct job_controls* controls, int exec_fd, int last_stage){
+    close_shell_fds();
+
+    // continue to ignore ^C for background processes,
+    // SIG_IGN will continue past execvp call
+    // for foreground processes we need to set behavior back to default (SIG_DFL), 
+    struct sigaction SIGINT_action = {0};
+    sigfillset(&SIGINT_action.sa_mask);
+    if (!background){  
+        // Register SIG_DFL as the signal handler
+        SIGINT_action.sa_handler = SIG_DFL;
+        // Install our signal handler
+        sigaction(SIGINT, &SIGINT_action, NULL);
+    }
+
+    // ignore ^Z for all child processes,
+    // SIG_IGN will continue past execvp call
+    // Register SIG_IGN as the signal handler
+    struct sigaction SIGTSTP_action = {0};
+    sigfillset(&SIGTSTP_action.sa_mask);
+    SIGTSTP_action.sa_handler = SIG_IGN;
+    // Install our signal handler
+    sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+
+    // SIGCHLD is only blocked for the shell's signalfd (and SIGTSTP while launching), the blocked mask would survive execvp
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    sigprocmask(SIG_SETMASK, &no_signals, NULL);
+
+    if (pgid != -1){
+        setpgid(0, pgid);
+    }
+    apply_controls(controls);
+
+    // hook up the pipes to the previous and next stages,
+    // the originals are all O_CLOEXEC so they go away on exec
+    if (in_fd != -1 && dup2(in_fd, 0) == -1){
+        printf("[input pipe redirection failed]\n");
+        fflush(stdout);
+        exit(2);
+    }
+    if (out_fd != -1 && dup2(out_fd, 1) == -1){
+        printf("[output pipe redirection failed]\n");
+        fflush(stdout);
+        exit(2);
+    }
+    if (err_fd != -1 && dup2(err_fd, 2) == -1){
+        printf("[error pipe redirection failed]\n");
+        fflush(stdout);
+        exit(2);
+    }
+
+    // Handle the redirections, these take priority over the pipes like they do in bash
+    // referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-processes-and-i-slash-o?module_item_id=22511479
+    if (stage->fanout){
+        fan_out(stage);
+    }
+    int failed = apply_redirections(stage, NULL);
+    if (failed){
+        exit(failed);
+    }
+
+    // a stage with no command just passes its data along
+    if (!stage->args[0]){
+        if (pump(0, 1) == -1){
+            perror("smallsh: pump");
+            exit(1);
+        }
+        exit(0);
+    }
+
+    // run the program at the path we looked up before forking,
+    // if it isn't there anymore (or wasn't found at all) let execvp search PATH and report the error
+    // (forked stages can get here in any order, so only the last stage stamps the trace, the same one that ends up stamping it with posix_spawn)
+    if (current_trace && last_stage){
+        current_trace->exec = trace_now();
+    }
+    // exec_fd is the write end of an O_CLOEXEC pipe the shell reads from, so it goes away when the exec works,
+    // otherwise the shell gets the errno and can forget a hashed path that isn't there anymore, see launch_pipeline()
+    if (stage->path){
+        execv(stage->path, stage->args);
+        if (errno == ENOENT && stage->path != stage->args[0] && exec_fd != -1){
+            int error = ENOENT;
+            write(exec_fd, &error, sizeof error);
+            close(exec_fd);
+            exec_fd = -1;
+        }
+    }
+    execvp(stage->args[0], stage->args);
+    if (exec_fd != -1){
+        int error = errno;
+        write(exec_fd, &error, sizeof error);
+        errno = error;
+    }
+    // execvp only returns if it fails, so next lines will only run in that case
+    fprintf(stderr, "smallsh: ");
+    fflush(stderr);
+    perror(stage->args[0]);
+    exit(2);
+}
+
+// launch a stage with posix_spawn(), which glibc implements with clone(CLONE_VM|CLONE_VFORK),
+// so the shell's address space is never copied, unlike with fork().
+// The redirection files are opened in the child by the spawn file actions, never by the shell,
+// "> a > b" fan-out needs fan_out()'s extra process so those stages are always forked.
+// The shell is suspended until the child execs (that's the vfork part), so a stage that redirects from or to a FIFO,
+// whose open waits for the other end, is left to fork() too, otherwise the whole shell would wait with it.
+// The caller has to have SIGTSTP ignored while this runs, since spawn attributes can only reset signals to SIG_DFL
+// (and SIG_IGN carries over into the child), see launch_pipeline().
+// Returns the child pid, or -1 if anything went wrong,
+// in which case the caller falls back to fork() + run_stage() so the error is reported exactly like it always has been
+// referenced from https://man7.org/linux/man-pages/man3/posix_spawn.3.html
+pid_t spawn_stage(struct stage* stage, int in_fd, int out_fd, int err_fd, int background, pid_t pgid){
+    pid_t childPid = -1;
+
+    // hook up the pipes first, then the redirections in order so they take priority like they do in bash
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != -1){
+        posix_spawn_file_actions_adddup2(&actions, in_fd, 0);
+    }
+    if (out_fd != -1){
+        posix_spawn_file_actions_adddup2(&actions, out_fd, 1);
+    }
+    if (err_fd != -1){
+        posix_spawn_file_actions_adddup2(&actions, err_fd, 2);
+    }
+    // the files are opened right onto the fds they're for, in the child, and a failed open fails the spawn
+    for (int j = 0; j < stage->redirection_count; j++){
+        struct redirection* redirection = &stage->redirections[j];
+        if (!redirection->file){
+            posix_spawn_file_actions_adddup2(&actions, redirection->source_fd, redirection->fd);
+            continue;
+        }
+        struct stat info;
+        if (stat(redirection->file, &info) == 0 && S_ISFIFO(info.st_mode)){
+            posix_spawn_file_actions_destroy(&actions);
+            return -1;
+        }
+        posix_spawn_file_actions_addopen(&actions, redirection->fd, redirection->file, redirection->flags, 0644);
+    }
+
+    // same signal setup as run_stage(): nothing blocked (so SIGCHLD is unblocked),
+    // ^C back to the default for foreground processes, background processes keep ignoring it
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    if (!background){
+        sigaddset(&signals, SIGINT);
+        posix_spawnattr_setsigdefault(&attr, &signals);
+        flags |= POSIX_SPAWN_SETSIGDEF;
+    }
+    // background (and -j scheduled) commands go in a process group of their own (pgid 0 starts a new one), like run_stage()
+    if (pgid != -1){
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    // run the program at the path we looked up, if that path has gone away since it was hashed,
+    // forget it and look it up again once (ENOENT can also be from a redirection, then the path is still there)
+    extern char** environ;
+    int error = ENOENT;
+    if (stage->path){
+        error = posix_spawn(&childPid, stage->path, &actions, &attr, stage->args, environ);
+        if (error == ENOENT && stage->path != stage->args[0] && access(stage->path, F_OK) == -1){
+            hash_forget(stage->args[0]);
+            stage->path = hash_lookup(stage->args[0]);
+            if (stage->path){
+                error = posix_spawn(&childPid, stage->path, &actions, &attr, stage->args, environ);
+            }
+        }
+    }
+    if (error){
+        childPid = -1;
+    }
+    // posix_spawn only returns once the child has exec'd (that's the vfork part), so this is when it happened
+    else if (current_trace){
+        current_trace->exec = trace_now();
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return childPid;
+}
+
+// 0/1 for whether a stage has redirections to or from files (not just "N>&M")
+int opens_files(const struct stage* stage){
+    for (int j = 0; j < stage->redirection_count; j++){
+        if (stage->redirections[j].file){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// fork off one process per stage, connected with pipes
+// puts the child pids in each stage's pid and returns how many were started,
+// which is less than stage_count only if a fork or pipe failed.
+// spool_fd is where a background command's output goes with -o (the last stage's stdout and everyone's stderr), -1 otherwise.
+// own_group puts the stages in a process group of their own, for background and -j scheduled commands, see signal_job()
+// referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-process-api-creating-and-terminating-processes?module_item_id=22511468
+// and https://canvas.oregonstate.edu/courses/1890465/pages/exploration-process-api-executing-a-new-program?module_item_id=22511470
+// and https://man7.org/linux/man-pages/man2/pipe.2.html
+int launch_pipeline(struct stage* stages, int stage_count, int background, int own_group, const struct job_controls* controls, int spool_fd){
+    // read end of the pipe coming from the previous stage
+    int in_fd = -1;
+    int launched = 0;
+    // the command's own process group, 0 until its first stage is started (which leads it), see signal_job(),
+    // -1 for commands that stay in the shell's group
+    pid_t pgid = own_group ? 0 : -1;
+
+    // spawned children have to ignore ^Z, and posix_spawn can't set SIG_IGN itself,
+    // so ignore it in the shell for the duration, with SIGTSTP blocked so a ^Z in the meantime
+    // is held until the handler is back instead of being lost
+    sigset_t tstp_mask;
+    struct sigaction SIGTSTP_saved;
+    if (!use_fork){
+        struct sigaction SIGTSTP_ignore = {0};
+        SIGTSTP_ignore.sa_handler = SIG_IGN;
+        sigemptyset(&tstp_mask);
+        sigaddset(&tstp_mask, SIGTSTP);
+        sigprocmask(SIG_BLOCK, &tstp_mask, NULL);
+        sigaction(SIGTSTP, &SIGTSTP_ignore, &SIGTSTP_saved);
+    }
+
+    for (int j = 0; j < stage_count; j++){
+        // every stage but the last writes into a new pipe
+        int pipe_fds[2] = {-1, -1};
+        if (j < stage_count-1){
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1){
+                perror("smallsh: pipe");
+                break;
+            }
+            // bigger pipes mean fewer trips through the scheduler for big transfers
+            if (splice_mode){
+                fcntl(pipe_fds[1], F_SETPIPE_SZ, PUMP_CHUNK);
+            }
+        }
+
+        // find the program in the command hash (or PATH) in the shell, so it gets remembered for next time
+        if (stages[j].args[0]){
+            stages[j].path = hash_lookup(stages[j].args[0]);
+        }
+        int out_fd = pipe_fds[1] != -1 ? pipe_fds[1] : spool_fd;
+        // per assignment specs, a background command reads /dev/null unless its input is redirected
+        // (it's in a process group of its own, so reading the terminal would just stop it, which goes for -j scheduled ones too).
+        // Foreground commands only get a group of their own when there's no terminal, so they keep the shell's input
+        if (own_group && j == 0 && (background || max_jobs > 1)){
+            in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+
+        // spawn the stage if we can, stages with no command run pump() in the child so they always need fork()
+        pid_t childPid = -1;
+        if (!use_fork && !needs_fork(controls) && !stages[j].fanout && stages[j].args[0]){
+            childPid = spawn_stage(&stages[j], in_fd, out_fd, spool_fd, background, pgid);
+        }
+
+        // Fork a new process, with a pipe the child reports a failed exec on (it closes on a successful one),
+        // only for stages that go straight to exec: one with redirection files could wait on opening one (a FIFO),
+        // and the shell waiting for its exec would wait too (that also leaves out fan-out, whose copier never execs)
+        int exec_fds[2] = {-1, -1};
+        if (childPid == -1){
+            if (stages[j].args[0] && !opens_files(&stages[j]) && pipe2(exec_fds, O_CLOEXEC) == -1){
+                exec_fds[0] = exec_fds[1] = -1;
+            }
+            childPid = fork();
+        }
+        if (childPid == -1){
+            // only happens if fork process fails
+            printf("[fork failed]\n");
+            fflush(stdout);
+            if (exec_fds[0] != -1){
+                close(exec_fds[0]);
+                close(exec_fds[1]);
+            }
+            if (pipe_fds[0] != -1){
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+            }
+            break;
+        }
+        else if (childPid == 0){
+            run_stage(&stages[j], in_fd, out_fd, spool_fd, background, pgid, controls, exec_fds[1], j == stage_count-1);
+        }
+        // wait for the exec, if the hashed path has gone away since it was looked up, forget it like spawn_stage() does
+        if (exec_fds[0] != -1){
+            close(exec_fds[1]);
+            int error = 0;
+            while (read(exec_fds[0], &error, sizeof error) == -1 && errno == EINTR){
+            }
+            if (error == ENOENT){
+                hash_forget(stages[j].args[0]);
+            }
+            close(exec_fds[0]);
+        }
+        // the child does this too, whichever gets there first, so the group exists before the next stage joins it
+        if (pgid != -1){
+            if (!pgid){
+                pgid = childPid;
+            }
+            setpgid(childPid, pgid);
+        }
+
+        // the shell keeps none of the pipe ends, only the read end for the next stage
+        stages[launched++].pid = childPid;
+        if (in_fd != -1){
+            close(in_fd);
+        }
+        if (pipe_fds[1] != -1){
+            close(pipe_fds[1]);
+        }
+        in_fd = pipe_fds[0];
+    }
+    if (in_fd != -1){
+        close(in_fd);
+    }
+    if (!use_fork){
+        sigaction(SIGTSTP, &SIGTSTP_saved, NULL);
+        sigprocmask(SIG_UNBLOCK, &tstp_mask, NULL);
+    }
+    return launched;
+}
+
+// add the processes of a pipeline that was just launched to the job table,
+// returns the leader (the last stage's job), which stands for the whole pipeline
+// with a deadline timeout seconds from now (0 for none)
+struct job* add_pipeline_jobs(struct stage* stages, int launched, const struct timespec* start, struct trace_record* trace, double timeout){
+    struct job* leader = job_add(stages[launched-1].pid);
+    leader->stages_left = launched;
+    leader->usage.start = *start;
+    if (trace){
+        leader->trace = trace;
+        leader->trace_seq = trace->seq;
+    }
+    for (int j = launched-2; j >= 0; j--){
+        struct job* member = job_add(stages[j].pid);
+        member->leader = leader;
+        member->next_member = leader->next_member;
+        leader->next_member = member;
+    }
+    if (timeout > 0){
+        deadline_add(leader, timeout);
+    }
+    return leader;
+}
+
+// run a pipeline of external commands, in the foreground (waiting for it) or in the background,
+// with the settings from its prefixes in controls
+void run_pipeline(struct stage* stages, int stage_count, int background_requested, struct job_controls* controls){
+    int background = background_requested && !foreground_only;
+    int timed = controls->timed;
+    double timeout = controls->timeout;
+
+    // with -r, background commands (that didn't ask for particular CPUs) each get the next CPU in turn,
+    // so CPU-bound ones don't all pile up on the same cores
+    if (background && round_robin && !controls->has_cpus){
+        while (!CPU_ISSET(next_cpu, &shell_cpus)){
+            next_cpu = (next_cpu + 1) % CPU_SETSIZE;
+        }
+        CPU_ZERO(&controls->cpus);
+        CPU_SET(next_cpu, &controls->cpus);
+        controls->has_cpus = 1;
+        next_cpu = (next_cpu + 1) % CPU_SETSIZE;
+    }
+
+    // with -j, foreground commands don't get waited for, they're scheduled as jobs,
+    // wait here until one of the max_jobs slots is free
+    int scheduled = !background && max_jobs > 1;
+    while (scheduled && running_scheduled_jobs >= max_jobs){
+        wait_for_child();
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    current_trace = trace_begin(stages[0].args, stage_count);
+    // with -o, a background command's output goes to a spool instead of the terminal,
+    // the shell only keeps the pipe's read end
+    struct spool* spool = NULL;
+    int spool_fd = -1;
+    if (background && spool_output){
+        spool = spool_create(&spool_fd);
+    }
+    // scheduled commands get a process group of their own too, so exit and timeouts reach whatever they start (see signal_job()),
+    // which also means ^C from the terminal doesn't. So do foreground commands when the shell isn't reading a terminal
+    // (a script on stdin, or a server worker), there's no ^C or ^Z for them then, and no terminal read to stop them
+    int own_group = background || scheduled || !isatty(STDIN_FILENO);
+    int launched = launch_pipeline(stages, stage_count, background, own_group, controls, spool_fd);
+    if (spool_fd != -1){
+        close(spool_fd);
+    }
+    struct trace_record* trace = current_trace;
+    current_trace = NULL;
+    if (trace && launched){
+        trace->pid = stages[launched-1].pid;
+    }
+
+    // parent process runs this code  
+
+    // if process is supposed to run in the background, 
+    // and we are not in foreground_only mode, 
+    // don't wait, just add the process ids to the job table,
+    // reap_children() will pick them up when SIGCHLD arrives.
+    // Only the last stage of a pipeline gets reported, like its status is the pipeline's status
+    if (background){
+        if (launched){
+            printf("Background pid is %d\n", stages[launched-1].pid);
+            fflush(stdout);
+            struct job* leader = add_pipeline_jobs(stages, launched, &start, trace, timeout);
+            leader->timed = timed;
+            leader->spool = spool;
+            leader->pgid = stages[0].pid;
+        }
+        else if (spool){
+            spool_free(spool);
+        }
+    }
+    // scheduled foreground commands are tracked like background processes, but quietly,
+    // reap_children() frees the slot and records the status when the last stage finishes
+    else if (scheduled){
+        if (launched){
+            struct job* leader = add_pipeline_jobs(stages, launched, &start, trace, timeout);
+            leader->quiet = 1;
+            leader->scheduled = (launched == stage_count);
+            leader->pgid = stages[0].pid;
+        }
+        if (launched == stage_count){
+            running_scheduled_jobs++;
+        }
+        else{
+            foreground_exit_status = 1 << 8;
+            foreground_timed_out = 0;
+            record_status(foreground_exit_status);
+        }
+    }
+    else{ 
+        
+        // wait for every stage to terminate, the same way background processes are reaped,
+        // so any of those that finish in the meantime get reaped (and timed) right away too.
+        // use foreground_exit_status to track status in main program, so we can print with status command,
+        // the pipeline's exit status is the exit status of its last stage, its usage is the total from wait4()
+        // referenced from https://man7.org/linux/man-pages/man2/wait4.2.html
+        if (launched){
+            struct job* leader = add_pipeline_jobs(stages, launched, &start, trace, timeout);
+            leader->foreground = 1;
+            leader->pgid = own_group ? stages[0].pid : 0;
+            if (trace){
+                trace->wait = trace_now();
+            }
+            while (leader->stages_left){
+                wait_for_child();
+            }
+            foreground_exit_status = leader->exit_status;
+            foreground_usage = leader->usage;
+            foreground_timed_out = leader->kill_stage != 0;
+            job_free(leader);
+        }
+        // only happens if a fork failed part way through the pipeline
+        if (launched < stage_count){
+            foreground_exit_status = 1 << 8;
+        }
+        record_status(foreground_exit_status);
+        // since we are running a foreground process, we need to print a message if it is terminated by a signal
+        // (or if we killed it for running out of time)
+        if (foreground_timed_out){
+            printf("timed out, ");
+        }
+        if(!WIFEXITED(foreground_exit_status)){
+            printf("terminated by signal %d\n", WTERMSIG(foreground_exit_status));
+            fflush(stdout);
+        } 
+        else if (foreground_timed_out){
+            printf("exit value %d\n", WEXITSTATUS(foreground_exit_status));
+            fflush(stdout);
+        }
+        if (timed){
+            print_usage(stderr, &foreground_usage);
+        }
+    }
+}
+
+// implement cd
+int cd_builtin(char** args){
+    fflush(stdout);
+    // if an argument after cd is provided, change to that directory
+    // adapted from Tree assignment
+    // and https://canvas.oregonstate.edu/courses/1890465/pages/exploration-environment?module_item_id=22511471
+    if (args[1]){
+        if (chdir(args[1]) == -1){
+            printf("[could not open directory %s]\n", args[1]);
+            fflush(stdout);
+            return 1;
+        }
+    }
+    else{
+        // otherwise go to main in HOME from environment
+        // per assignment specs https://canvas.oregonstate.edu/courses/1890465/assignments/8990536?module_item_id=22511473
+        if (chdir(getenv("HOME")) == -1){
+            printf("[could not open home directory]\n");
+            fflush(stdout);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// implement status
+// with -v, also show the resources the last foreground command used
+int status_builtin(char** args){
+    if (foreground_timed_out){
+        printf("timed out, ");
+    }
+    // get exit info from WIFEXITED/WEXITSTATUS, 
+    // referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-process-api-monitoring-child-processes?module_item_id=22511469
+    if(WIFEXITED(foreground_exit_status)){
+        printf("exit value %d\n", WEXITSTATUS(foreground_exit_status));
         fflush(stdout);
-        foreground_only = 0;
+    } 
+    else{
+        printf("terminated by signal %d\n", WTERMSIG(foreground_exit_status));
+        fflush(stdout);
+    }
+    if (args[1] && strcmp(args[1], "-v") == 0){
+        print_usage(stdout, &foreground_usage);
+    }
+    return 0;
+}
+
+// whether word is one of /bin/echo's option words, e.g. -n, -e or -neE
+// referenced from https://man7.org/linux/man-pages/man1/echo.1.html
+int echo_option(const char* word){
+    if (word[0] != '-' || !word[1]){
+        return 0;
+    }
+    return strspn(word + 1, "neE") == strlen(word + 1);
+}
+
+// echo only handles -n itself, the escapes (-e) are left to /bin/echo
+int echo_handles(char** args){
+    for (int j = 1; args[j] && echo_option(args[j]); j++){
+        if (strcmp(args[j], "-n") != 0){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// implement echo, with -n to leave off the newline
+int echo_builtin(char** args){
+    int j = 1;
+    int newline = 1;
+    while (args[j] && strcmp(args[j], "-n") == 0){
+        newline = 0;
+        j++;
+    }
+    for (int first = j; args[j]; j++){
+        if (j > first){
+            putchar(' ');
+        }
+        fputs(args[j], stdout);
+    }
+    if (newline){
+        putchar('\n');
+    }
+    return 0;
+}
+
+// implement true and false
+int true_builtin(char** args){
+    return 0;
+}
+
+int false_builtin(char** args){
+    return 1;
+}
+
+// pwd prints the physical directory (getcwd), so -L (the logical one, from $PWD) is left to /bin/pwd
+int pwd_handles(char** args){
+    return !args[1] || (strcmp(args[1], "-P") == 0 && !args[2]);
+}
+
+// implement pwd
+int pwd_builtin(char** args){
+    static char* cwd = NULL;
+    static size_t cwd_capacity = 0;
+    cwd = grow(cwd, &cwd_capacity, 256, 1);
+    while (!getcwd(cwd, cwd_capacity)){
+        if (errno != ERANGE){
+            perror("smallsh: pwd");
+            return 1;
+        }
+        cwd = grow(cwd, &cwd_capacity, cwd_capacity + 1, 1);
+    }
+    puts(cwd);
+    return 0;
+}
+
+// whether test_expression() knows the form of the expression (count words starting at args),
+// the rest (-L, -nt, -a/-o, parentheses, ...) run as /usr/bin/test instead
+int test_supported(char** args, int count){
+    while (count && strcmp(args[0], "!") == 0){
+        args++;
+        count--;
+    }
+    if (count <= 1){
+        return 1;
+    }
+    if (count == 2){
+        return args[0][0] == '-' && args[0][1] && !args[0][2] && strchr("nzefdsrwx", args[0][1]);
+    }
+    if (count == 3){
+        const char* ops[] = { "=", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+        for (int j = 0; j < 8; j++){
+            if (strcmp(args[1], ops[j]) == 0){
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// evaluate one test expression (args is its null terminated list of words),
+// returns 0 for true, 1 for false, 2 for a syntax error, like test's exit status
+int test_expression(char** args, int count){
+    // ! negates the rest
+    if (count && strcmp(args[0], "!") == 0){
+        int result = test_expression(args + 1, count - 1);
+        return result == 2 ? 2 : !result;
+    }
+    // no arguments is false, one argument is true if it's not empty
+    if (count == 0){
+        return 1;
+    }
+    if (count == 1){
+        return args[0][0] == '\0';
+    }
+
+    // unary operators: string and file tests
+    // referenced from https://man7.org/linux/man-pages/man1/test.1.html
+    if (count == 2 && args[0][0] == '-' && args[0][1] && !args[0][2]){
+        struct stat info;
+        switch (args[0][1]){
+            case 'n': return args[1][0] == '\0';
+            case 'z': return args[1][0] != '\0';
+            case 'e': return stat(args[1], &info) != 0;
+            case 'f': return !(stat(args[1], &info) == 0 && S_ISREG(info.st_mode));
+            case 'd': return !(stat(args[1], &info) == 0 && S_ISDIR(info.st_mode));
+            case 's': return !(stat(args[1], &info) == 0 && info.st_size > 0);
+            case 'r': return access(args[1], R_OK) != 0;
+            case 'w': return access(args[1], W_OK) != 0;
+            case 'x': return access(args[1], X_OK) != 0;
+        }
+    }
+
+    // binary operators: string and integer comparisons
+    if (count == 3){
+        const char* op = args[1];
+        if (strcmp(op, "=") == 0){
+            return strcmp(args[0], args[2]) != 0;
+        }
+        if (strcmp(op, "!=") == 0){
+            return strcmp(args[0], args[2]) == 0;
+        }
+        const char* ops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+        for (int j = 0; j < 6; j++){
+            if (strcmp(op, ops[j]) == 0){
+                char* end1;
+                char* end2;
+                long left = strtol(args[0], &end1, 10);
+                long right = strtol(args[2], &end2, 10);
+                if (*end1 || *end2 || !args[0][0] || !args[2][0]){
+                    fprintf(stderr, "smallsh: test: integer expression expected\n");
+                    return 2;
+                }
+                int results[] = { left == right, left != right, left < right, left <= right, left > right, left >= right };
+                return !results[j];
+            }
+        }
+    }
+
+    fprintf(stderr, "smallsh: test: unsupported expression\n");
+    return 2;
+}
+
+// implement test, and [ which is the same thing with a ] at the end
+int test_builtin(char** args){
+    int count = 0;
+    while (args[count + 1]){
+        count++;
+    }
+    if (strcmp(args[0], "[") == 0){
+        if (!count || strcmp(args[count], "]") != 0){
+            fprintf(stderr, "smallsh: [: missing ]\n");
+            return 2;
+        }
+        count--;
+    }
+    return test_expression(args + 1, count);
+}
+
+int test_handles(char** args){
+    int count = 0;
+    while (args[count + 1]){
+        count++;
+    }
+    // a [ without its ] is an error either way
+    if (strcmp(args[0], "[") == 0 && count && strcmp(args[count], "]") == 0){
+        count--;
+    }
+    return test_supported(args + 1, count);
+}
+
+// a command that runs inside the shell process instead of being forked off,
+// run returns the command's exit value
+struct builtin {
+    const char* name;
+    int (*run)(char** args);
+    // 0/1 for whether it counts as a foreground command, i.e. sets the status like the external version would.
+    // cd, status etc. are about the shell itself so they leave it alone, per the assignment specs
+    int sets_status;
+    // NULL if it handles any arguments, otherwise whether it handles these ones,
+    // when it doesn't the external version of the command runs instead
+    int (*handles)(char** args);
+};
+
+// dispatch table of built in commands,
+// the trivial ones (echo, true, ...) are here so that scripts calling them constantly don't pay for a fork and exec each time
+const struct builtin builtins[] = {
+    { "cd", cd_builtin, 0, NULL },
+    { "status", status_builtin, 0, NULL },
+    { "wait", wait_builtin, 0, NULL },
+    { "jobs", jobs_builtin, 0, NULL },
+    { "output", output_builtin, 0, NULL },
+    { "hash", hash_builtin, 0, NULL },
+    { "trace", trace_builtin, 0, NULL },
+    { "echo", echo_builtin, 1, echo_handles },
+    { "true", true_builtin, 1, NULL },
+    { "false", false_builtin, 1, NULL },
+    { "pwd", pwd_builtin, 1, pwd_handles },
+    { "test", test_builtin, 1, test_handles },
+    { "[", test_builtin, 1, test_handles },
+};
+
+// look up a built in command by name, returns NULL if it isn't one
+const struct builtin* find_builtin(const char* name){
+    if (!name){
+        return NULL;
+    }
+    for (size_t j = 0; j < sizeof(builtins) / sizeof(builtins[0]); j++){
+        if (strcmp(builtins[j].name, name) == 0){
+            return &builtins[j];
+        }
+    }
+    return NULL;
+}
+
+// the built in command to run this command line with right in the shell, or NULL to run it as processes.
+// Built ins in a pipeline run as their external versions instead (/bin/echo etc.), and so do ones with
+// cpus/nice/limit prefixes or "> a > b" fan-out, which need a process of their own, and ones given arguments they don't handle.
+// The ones about the shell itself (cd, status, ...) ignore '&', per the directions:
+// "If the user tries to run one of these built-in commands in the background with the & option,
+// ignore that option and run the command in the foreground anyway
+// (i.e. don't display an error, just run the command in the foreground)."
+// but the trivial ones (echo, true, ...) only stand in for their external versions in the foreground,
+// "echo hi &" goes to the background like any other command (unless we're in foreground-only mode)
+const struct builtin* shell_builtin(struct stage* stages, int stage_count, const struct job_controls* controls, int background){
+    if (stage_count != 1 || needs_fork(controls) || stages[0].fanout){
+        return NULL;
+    }
+    const struct builtin* builtin = find_builtin(stages[0].args[0]);
+    if (!builtin || (builtin->handles && !builtin->handles(stages[0].args))){
+        return NULL;
+    }
+    if (builtin->sets_status && background && !foreground_only){
+        return NULL;
+    }
+    return builtin;
+}
+
+// run a built in command in the shell process.
+// Its redirections are applied to the shell's own fds, after saving the originals, see apply_redirections(),
+// and put back afterwards, with the same error messages and exit values the child process would give
+int run_builtin(const struct builtin* builtin, struct stage* stage){
+    static int* saved = NULL;
+    static size_t saved_capacity = 0;
+    saved = grow(saved, &saved_capacity, stage->redirection_count + 1, sizeof(int));
+    for (int j = 0; j < stage->redirection_count; j++){
+        saved[j] = -2;
+    }
+    fflush(stdout);
+
+    int result = apply_redirections(stage, saved);
+    if (!result){
+        result = builtin->run(stage->args);
+    }
+
+    // put the shell's own fds back
+    fflush(stdout);
+    restore_redirections(stage, saved);
+    return result;
+}
+
+// send the client one reply line for the command line we just handled, in server mode (--serve).
+// reply is "background" for a background command, "error" for one that didn't parse,
+// "ok" for a blank or comment line, "parsed" for a command with -n, "exit" for exit (the connection closes right after),
+// and otherwise NULL for the foreground status, worded like the status command's.
+// Does nothing when we're not serving a connection
+void serve_reply(const char* reply){
+    if (serve_fd == -1){
+        return;
+    }
+    char line[64];
+    if (reply){
+        snprintf(line, sizeof(line), "%s\n", reply);
+    }
+    else if (WIFEXITED(foreground_exit_status)){
+        snprintf(line, sizeof(line), "%sexit value %d\n", foreground_timed_out ? "timed out, " : "", WEXITSTATUS(foreground_exit_status));
+    }
+    else{
+        snprintf(line, sizeof(line), "%sterminated by signal %d\n", foreground_timed_out ? "timed out, " : "", WTERMSIG(foreground_exit_status));
     }
+    // MSG_NOSIGNAL so a client that went away gets us EPIPE instead of SIGPIPE, the session then ends at the next read
+    if (send(serve_fd, line, strlen(line), MSG_NOSIGNAL) == -1 && errno != EPIPE && errno != ECONNRESET){
+        perror("smallsh: send");
+    }
+}
+
+// make a Unix domain socket address for path, returns -1 if the path is too long for one
+// referenced from https://man7.org/linux/man-pages/man7/unix.7.html
+int socket_address(const char* path, struct sockaddr_un* address){
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)){
+        fprintf(stderr, "smallsh: socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+// server mode (--serve path): listen on a Unix domain socket and run the command lines clients send,
+// one reply line per command (see serve_reply()).
+// This process only keeps a pool of worker processes forked ahead of time (--workers, one per CPU by default),
+// each one already set up and sitting in accept(), so a new connection doesn't wait for a fork.
+// A worker serves one connection: it returns from here into main with input_fd set to the connection,
+// and runs its commands with the same loop as a script, then exits when the client hangs up,
+// and this process forks a fresh one to take its place.
+// referenced from https://man7.org/linux/man-pages/man2/accept.2.html
+void serve(const char* path, int workers){
+    struct sockaddr_un address;
+    if (socket_address(path, &address) == -1){
+        exit(1);
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    // a socket file left over from an earlier server would make bind() fail
+    unlink(path);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(listen_fd, SOMAXCONN) == -1){
+        fprintf(stderr, "smallsh: ");
+        perror(path);
+        exit(1);
+    }
+    printf("smallsh: serving on %s with %d workers\n", path, workers);
+    fflush(stdout);
+
+    pid_t server_pid = getpid();
+    int running = 0;
+    for(;;){
+        // top the pool back up
+        while (running < workers){
+            pid_t worker = fork();
+            if (worker == -1){
+                perror("smallsh: fork");
+                break;
+            }
+            if (worker == 0){
+                // don't outlive the server (it can't clean up workers it never hears about)
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                if (getppid() != server_pid){
+                    exit(0);
+                }
+                // commands read from /dev/null instead of whatever the server was started with
+                int null_fd = open("/dev/null", O_RDONLY);
+                if (null_fd != -1){
+                    dup2(null_fd, STDIN_FILENO);
+                    close(null_fd);
+                }
+                int connection;
+                do{
+                    connection = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                } while (connection == -1 && errno == EINTR);
+                if (connection == -1){
+                    perror("smallsh: accept");
+                    exit(1);
+                }
+                close(listen_fd);
+                serve_fd = connection;
+                input_fd = connection;
+                batch_mode = 1;
+                return;
+            }
+            running++;
+        }
+
+        // wait for a worker to finish its connection (SIGCHLD isn't blocked yet at this point)
+        if (wait(NULL) > 0){
+            running--;
+        }
+        else if (errno != EINTR){
+            // fork kept failing and there's no worker left to wait for, try again in a bit
+            sleep(1);
+        }
+    }
+}
+
+// compare two latencies, for qsort()
+int compare_latency(const void* a, const void* b){
+    int64_t difference = *(const int64_t*) a - *(const int64_t*) b;
+    return (difference > 0) - (difference < 0);
+}
+
+// load generator (--load path): send a server (--serve path) the same command line, requests times,
+// over a number of connections at once, each sending its next command as soon as the reply to the last one comes back.
+// Prints the requests per second, and the median and 99th percentile latency (from sending a command until its reply).
+// Each connection ties up a server worker until it's done, so use no more connections than the server has workers
+int load(const char* path, long requests, int connections, const char* line){
+    struct sockaddr_un address;
+    if (socket_address(path, &address) == -1){
+        return 1;
+    }
+    if (connections < 1 || requests < connections){
+        fprintf(stderr, "smallsh: --load needs at least one request per connection\n");
+        return 1;
+    }
+    size_t line_length = strlen(line);
+    char* request = malloc(line_length + 2);
+    int64_t* latencies = malloc(requests * sizeof(int64_t));
+    int64_t* sent = calloc(connections, sizeof(int64_t));
+    long* left = calloc(connections, sizeof(long));
+    int* fds = calloc(connections, sizeof(int));
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!request || !latencies || !sent || !left || !fds || epoll_fd == -1){
+        perror("smallsh: --load");
+        return 1;
+    }
+    memcpy(request, line, line_length);
+    request[line_length] = '\n';
+    request[line_length + 1] = '\0';
+    signal(SIGPIPE, SIG_IGN);
+
+    // split up the requests, then connect and send everyone's first one
+    int64_t started = trace_now();
+    for (int j = 0; j < connections; j++){
+        left[j] = requests / connections + (j < requests % connections);
+        fds[j] = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fds[j] == -1 || connect(fds[j], (struct sockaddr*) &address, sizeof(address)) == -1){
+            fprintf(stderr, "smallsh: ");
+            perror(path);
+            return 1;
+        }
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = j };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[j], &event);
+        sent[j] = trace_now();
+        if (write(fds[j], request, line_length + 1) == -1){
+            perror("smallsh: write");
+            return 1;
+        }
+    }
+
+    // every reply is one line, count the newlines
+    long completed = 0;
+    long failed = 0;
+    char buffer[4096];
+    int open_connections = connections;
+    while (open_connections){
+        struct epoll_event events[64];
+        int ready = epoll_wait(epoll_fd, events, 64, -1);
+        if (ready == -1 && errno != EINTR){
+            perror("smallsh: epoll_wait");
+            return 1;
+        }
+        for (int e = 0; e < ready; e++){
+            int j = events[e].data.u32;
+            ssize_t n = read(fds[j], buffer, sizeof(buffer));
+            if (n <= 0){
+                fprintf(stderr, "smallsh: server closed connection %d with %ld requests left\n", j, left[j]);
+                close(fds[j]);
+                open_connections--;
+                continue;
+            }
+            int64_t now = trace_now();
+            // (there's only ever one request waiting per connection, so a read has at most one reply)
+            for (char* reply = buffer, *p; (p = memchr(reply, '\n', buffer + n - reply)); reply = p + 1){
+                if (p - reply != 12 || strncmp(reply, "exit value 0", 12) != 0){
+                    failed++;
+                }
+                latencies[completed++] = now - sent[j];
+                if (--left[j] == 0){
+                    close(fds[j]);
+                    open_connections--;
+                    break;
+                }
+                sent[j] = now;
+                if (write(fds[j], request, line_length + 1) == -1){
+                    perror("smallsh: write");
+                    return 1;
+                }
+            }
+        }
+    }
+    int64_t elapsed = trace_now() - started;
+    close(epoll_fd);
+    free(request);
+    free(sent);
+    free(left);
+    free(fds);
+
+    if (completed == 0){
+        free(latencies);
+        return 1;
+    }
+    qsort(latencies, completed, sizeof(int64_t), compare_latency);
+    printf("%ld requests over %d connections in %.3fs: %.0f requests/s, p50 %.1f us, p99 %.1f us, max %.1f us, %ld not \"exit value 0\"\n",
+        completed, connections, elapsed / 1e9, completed / (elapsed / 1e9),
+        latencies[completed / 2] / 1e3, latencies[(completed * 99) / 100] / 1e3, latencies[completed - 1] / 1e3, failed);
+    fflush(stdout);
+    free(latencies);
+    return completed < requests || failed;
 }
 
-int main(){
+int main(int argc, char* argv[]){
+    // command line options, the server and load generator ones only have long names
+    // referenced from https://man7.org/linux/man-pages/man3/getopt.3.html
+    enum { SERVE = 256, WORKERS, LOAD, REQUESTS, CONNECTIONS, COMMAND };
+    const struct option long_options[] = {
+        { "serve", required_argument, NULL, SERVE },
+        { "workers", required_argument, NULL, WORKERS },
+        { "load", required_argument, NULL, LOAD },
+        { "requests", required_argument, NULL, REQUESTS },
+        { "connections", required_argument, NULL, CONNECTIONS },
+        { "command", required_argument, NULL, COMMAND },
+        { NULL, 0, NULL, 0 },
+    };
+    const char* serve_path = NULL;
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* load_path = NULL;
+    long requests = 10000;
+    int connections = 1;
+    const char* load_command = "/bin/true";
+    int opt;
+    while ((opt = getopt_long(argc, argv, "nsvrol:f:j:t:k:", long_options, NULL)) != -1){
+        switch (opt){
+            case SERVE:
+                serve_path = optarg;
+                break;
+            case LOAD:
+                load_path = optarg;
+                break;
+            case COMMAND:
+                load_command = optarg;
+                break;
+            case WORKERS:
+            case REQUESTS:
+            case CONNECTIONS:{
+                char* end;
+                long count = strtol(optarg, &end, 10);
+                if (*end || count < 1){
+                    fprintf(stderr, "smallsh: --%s needs a positive number\n", long_options[opt - SERVE].name);
+                    exit(1);
+                }
+                if (opt == WORKERS){
+                    workers = count;
+                }
+                else if (opt == REQUESTS){
+                    requests = count;
+                }
+                else{
+                    connections = count;
+                }
+                break;
+            }
+            case 'r':
+                // spread background commands over the CPUs the shell is allowed to use
+                if (sched_getaffinity(0, sizeof(cpu_set_t), &shell_cpus) == -1){
+                    perror("smallsh: sched_getaffinity");
+                    exit(1);
+                }
+                round_robin = 1;
+                break;
+            case 't':
+            case 'k':{
+                char* end;
+                double seconds = strtod(optarg, &end);
+                if (*end || seconds < 0){
+                    fprintf(stderr, "smallsh: -%c needs a number of seconds\n", opt);
+                    exit(1);
+                }
+                if (opt == 't'){
+                    default_timeout = seconds;
+                }
+                else{
+                    kill_grace = seconds;
+                }
+                break;
+            }
+            case 'v':
+                verbose_jobs = 1;
+                break;
+            case 'o':
+                spool_output = 1;
+                break;
+            case 'f':
+                batch_mode = 1;
+                open_script(optarg);
+                break;
+            case 'j':{
+                char* end;
+                max_jobs = strtol(optarg, &end, 10);
+                if (*end || max_jobs < 0){
+                    fprintf(stderr, "smallsh: -j needs a number of jobs\n");
+                    exit(1);
+                }
+                // -j 0 means one per CPU
+                if (max_jobs == 0){
+                    max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                break;
+            }
+            case 'n':
+                parse_only = 1;
+                break;
+            case 's':
+                splice_mode = 1;
+                break;
+            case 'l':
+                if (strcmp(optarg, "fork") == 0){
+                    use_fork = 1;
+                    break;
+                }
+                else if (strcmp(optarg, "spawn") == 0){
+                    use_fork = 0;
+                    break;
+                }
+                // fall through
+            default:
+                fprintf(stderr, "usage: %s [-n] [-s] [-v] [-r] [-o] [-l spawn|fork] [-f script] [-j jobs] [-t timeout] [-k grace] [--serve socket [--workers n]]\n"
+                                "       %s --load socket [--requests n] [--connections n] [--command line]\n", argv[0], argv[0]);
+                exit(1);
+        }
+    }
+
+    // the load generator is a client, it doesn't run a shell at all
+    if (load_path){
+        return load(load_path, requests, connections, load_command);
+    }
+
     // set up signal handling/ignoring stuff,
     // referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-signals-concepts-and-types?module_item_id=22511477
     // and https://canvas.oregonstate.edu/courses/1890465/pages/exploration-signal-handling-api?module_item_id=22511478
@@ -91,331 +3544,195 @@ int main(){
     // Install our signal handler
 	  sigaction(SIGTSTP, &SIGTSTP_action, NULL);
 
+    // in server mode this process becomes the pool manager and never gets past here,
+    // the workers it forks come back out of serve() each with a client connection as their input
+    if (serve_path){
+        serve(serve_path, workers);
+    }
+
     // get process_id
     // referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-process-concept-and-states?module_item_id=22511467
     pid_t process_id = getpid();
-    // set a foreground exit status code to be used later when status is called
-    int foreground_exit_status = 0;
-    // and a background_exit_status, for background processes (checked before input)
-    int background_exit_status = 0;
+    pid_length = snprintf(pid_string, sizeof(pid_string), "%jd", (intmax_t) process_id);
+    // block SIGCHLD and have it delivered through sigchld_fd instead, see reap_children() and read_line()
+    // (children get it unblocked again before they exec, see the fork if/else block further down)
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+    sigchld_fd = signalfd(-1, &sigchld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd == -1){
+        perror("smallsh: signalfd");
+        exit(1);
+    }
+
+    // deadlines fire through timer_fd, and both it and sigchld_fd go into the event loop, see wait_for_event()
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    events_fd = epoll_create1(EPOLL_CLOEXEC);
+    input_events_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (timer_fd == -1 || events_fd == -1 || input_events_fd == -1){
+        perror("smallsh: timerfd/epoll");
+        exit(1);
+    }
+    int watched[] = { sigchld_fd, timer_fd };
+    for (int j = 0; j < 2; j++){
+        struct epoll_event event = { .events = EPOLLIN, .data.fd = watched[j] };
+        epoll_ctl(events_fd, EPOLL_CTL_ADD, watched[j], &event);
+        epoll_ctl(input_events_fd, EPOLL_CTL_ADD, watched[j], &event);
+    }
+    // the input only goes in the second one, epoll refuses regular files (which are always ready anyway)
+    struct epoll_event input_event = { .events = EPOLLIN, .data.fd = input_fd };
+    if (epoll_ctl(input_events_fd, EPOLL_CTL_ADD, input_fd, &input_event) == -1){
+        input_pollable = 0;
+    }
+
+    // per-command tracing, if SMALLSH_TRACE is set
+    trace_init();
     
     for(;;){
-        // just before prompt, check for terminated child processes and print a message if any terminated
-        // set up a new pid_t "terminatedChild", and call waitpid() on each potential member of processes array
-        // (so it will wait for any child process there),
-        // have it put the exit status in background_exit_status,
-        // and don't wait for this to finish, set it to WNOHANG, 
-        // this will return the pid of any terminated processes into the terminatedChild pid_t, 
-        // which we can then print, 
-        // then we can print the exit info (similar to calling "status" from the command line)
+        // just before prompt, print a message for any background processes that terminated,
+        // they have usually been reaped by reap_children() as soon as they exited,
+        // but check once more in case they finished while a foreground process was running
         // referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-process-api-monitoring-child-processes?module_item_id=22511469
-        // and https://man7.org/linux/man-pages/man3/wait.3p.html
-        pid_t terminatedChild;
-        for (int j = 0; j < 5; j++) {
-            if (processes[j]){
-                while ((terminatedChild = waitpid(processes[j], &background_exit_status, WNOHANG)) > 0) {
-                    printf("Background pid %d is done: ", terminatedChild);
-                    fflush(stdout);
-                    // get exit info from WIFEXITED/WEXITSTATUS, 
-                    // this is basically identical to the "status" command below
-                    // referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-process-api-monitoring-child-processes?module_item_id=22511469
-                    if(WIFEXITED(background_exit_status)){
-                        printf("exit value %d\n", WEXITSTATUS(background_exit_status));
-                        fflush(stdout);
-                    } 
-                    else{
-                        printf("terminated by signal %d\n", WTERMSIG(background_exit_status));
-                        fflush(stdout);
-                    }
-                    processes[j] = 0;
-                }
-            }
+        reap_children();
+        report_done_jobs();
+
+        // print prompt (scripts don't get one)
+        if (!batch_mode){
+            printf(": ");
+            fflush(stdout);
         }
 
-        // print prompt
-        printf(": ");
-        fflush(stdout);
+        // now we need to get the input from stdin (or the script),
+        // read_line() also takes care of cleaning up the trailing newline character
+        size_t string_length;
+        char* string = read_line(&string_length);
+        if (trace_ring){
+            trace_parse_started = trace_now();
+        }
 
-        // now we need to get the input from stdin
-        // set up a buffer big enough to hold 2048 characters, plus null terminator, plus potential newline character
-        // initialized with 0's, so we don't accidentally underwrite on next loop
-        // referenced from Base64 assignment
-        char string[MAXINPUT+2] = {0};
-        
-        // get input from stdin and put it into string
-        fgets(string, MAXINPUT+2, stdin);
-        
-        // Clean up potential trailing newline character left by fgets, null terminate instead
-        for (int j = 0; j < MAXINPUT+2; j++) {
-            if (string[j] == '\n'){
-                string[j] = '\0';
+        // treat end of input like the exit command,
+        // but at the end of a script (or with -j) let the jobs it started finish first
+        if (!string){
+            if (batch_mode || max_jobs > 1){
+                while (jobs.count){
+                    wait_for_child();
+                }
+                report_done_jobs();
             }
+            string = "exit";
+            string_length = 4;
         }
         
         // if empty input or a comment line is received, we don't have to do anything
-        // we can go back to asking for input
+        // we can go back to asking for input (a server's client still gets its one reply per line)
         if ((strcmp(string, "") == 0) || (string[0] == '#')){
+            serve_reply("ok");
             continue;
         }
 
-        // if exit input received, kill any leftover processes and exit input loop
-        else if (strcmp(string, "exit") == 0){
-            for(int j = 0; j < 5; j++) {
-                if (processes[j]){
-                    kill(processes[j], SIGTERM);
-                }
-            }
-            break;
-        }
-        
         // otherwise process the input
         else{
-            // create an array of pointers to strings, to hold the arguments,
-            // filled with NULL, so it's null terminated later
-            // setup referenced from https://overiq.com/c-programming-101/array-of-pointers-to-strings-in-c/
-            // to facilitate execvp() later, which takes char *const argv[]
-            // per https://canvas.oregonstate.edu/courses/1890465/pages/exploration-process-api-executing-a-new-program?module_item_id=22511470
-            // set an i counter at 0 to fill this array later
-            // create input_file and output_file string arrays
-            // and create a 0/1 int to act as a boolean for whether the command should be a background process
-            char* args[MAXARGS];
-            for (int j=0; j<MAXARGS; j++) {
-                args[j] = NULL;
-            }
-            int i = 0;
-            char input_file[MAXINPUT+2] = {0}; 
-            char output_file[MAXINPUT+2] = {0};
-            int background_process = 0;
-            
-            // break up string
-            // referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-strings?module_item_id=22511451
-            // and https://www.youtube.com/watch?v=34DnZ2ewyZo
-            char* token = strtok(string, " ");
-            while (token != NULL){
-            
-                // check for input file
-                if (!strcmp(token, "<")){
-                    // manually jump ahead one token to file name
-                    token = strtok(NULL, " ");
-                    strcpy(input_file, token);
-                }
-                
-                // check for output file
-                else if (!strcmp(token, ">")){
-                    // manually jump ahead one token to file name
-                    token = strtok(NULL, " ");
-                    strcpy(output_file, token);
-                } 
-                
-                // otherwise put it in the argument array
-                else{
-                    args[i] = strdup(token);
-                    // get length of string we just copied
-                    int length = 0;
-                    while (args[i][length] != '\0') {
-                        length++;
-                    }
-
-                    // expand $$ to process_id
-                    // search through arg we just added for "$$""
-                    for (int j = 0; j < length; j++) {
-                        if ((args[i][j] == '$') && (args[i][j+1] == '$')){
-                            // since in the test script $$ only happens at the end of the given argument,
-                            // when $$ found, null terminate string at first $ (cutting off $$),
-                            // use snprintf to write the pid into a string array,
-                            // and concatenate that pid_string to args[i]
-                            // snprintf usage referenced from https://edstem.org/us/courses/29177/discussion/2053610
-                            args[i][j] = '\0';
-                            char pid_string[MAXINPUT+2] = {0};
-                            snprintf(pid_string, MAXINPUT+2, "%jd", (intmax_t) process_id);
-                            strncat(args[i], pid_string, MAXINPUT+2-j);
-                        }
-                    } 
-                    // go to next spot in args array
-                    i++;
-                }
-
-                // get next token
-                token = strtok(NULL, " ");
-            }
-
-            // check for background process flag "&"
-            for (int j = 0; j < 500; j++){
-                if (args[j] && (strcmp(args[j], "&") == 0) && !args[j+1]){
-                    // set background_process to 1
-                    background_process = 1;
-                    // clear extra argument
-                    args[j] = NULL;
-                    break;
-                }
+            // break up string into the stages of a pipeline, with their arguments and redirections,
+            // see parse_line() for the details
+            if (parse_line(string, string_length, &command) == -1){
+                serve_reply("error");
+                continue;
+            }
+            // a line of nothing but spaces and tabs is a blank line too, it leaves the status alone
+            if (command.stage_count == 1 && !command.args[0] && !command.stages[0].redirection_count){
+                serve_reply("ok");
+                continue;
             }
 
-            // implement cd
-            if (strcmp(args[0], "cd") == 0){
-                fflush(stdout);
-                // if an argument after cd is provided, change to that directory
-                // adapted from Tree assignment
-                // and https://canvas.oregonstate.edu/courses/1890465/pages/exploration-environment?module_item_id=22511471
-                if (args[1]){
-                    fflush(stdout);
-                    if (chdir(args[1]) == -1){
-                        printf("[could not open directory %s]\n", args[1]);
-                        fflush(stdout);
-                    }
-                fflush(stdout);
+            // if exit input received, stop any leftover processes (see exit_jobs()) and exit input loop
+            if (command.stage_count == 1 && command.args[0] && strcmp(command.args[0], "exit") == 0){
+                if (exit_jobs(command.args) == -1){
+                    serve_reply("error");
+                    continue;
                 }
-                else{
-                    // otherwise go to main in HOME from environment
-                    // per assignment specs https://canvas.oregonstate.edu/courses/1890465/assignments/8990536?module_item_id=22511473
-                    if (chdir(getenv("HOME")) == -1){
-                        printf("[could not open home directory]\n");
-                        fflush(stdout);
+                // the client knows the worker is closing the connection on purpose
+                serve_reply("exit");
+                // write out the trace, to SMALLSH_TRACE_FILE or smallsh-trace.<pid>.jsonl
+                if (trace_ring){
+                    const char* trace_file = getenv("SMALLSH_TRACE_FILE");
+                    char default_file[64];
+                    if (!trace_file){
+                        snprintf(default_file, sizeof(default_file), "smallsh-trace.%s.jsonl", pid_string);
+                        trace_file = default_file;
                     }
+                    trace_dump(trace_file);
                 }
+                break;
+            }
+            // with -n we only check the syntax
+            if (parse_only){
+                serve_reply("parsed");
+                continue;
             }
+            char** args = command.args;
+            struct stage* stages = command.stages;
+            int stage_count = command.stage_count;
+            const struct builtin* builtin;
 
-            // implement status
-            else if (strcmp(args[0], "status") == 0){
-                // ignore '&' command after status for the "status &" test, per directions:
-                // "If the user tries to run one of these built-in commands in the background with the & option, 
-                // ignore that option and run the command in the foreground anyway 
-                // (i.e. don't display an error, just run the command in the foreground)."
-                // get exit info from WIFEXITED/WEXITSTATUS, 
-                // referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-process-api-monitoring-child-processes?module_item_id=22511469
-                if(WIFEXITED(foreground_exit_status)){
-                    printf("exit value %d\n", WEXITSTATUS(foreground_exit_status));
-                    fflush(stdout);
-                } 
-                else{
-                    printf("terminated by signal %d\n", WTERMSIG(foreground_exit_status));
-                    fflush(stdout);
-                }
+            // take off the prefixes (time, timeout, cpus, nice, limit), see parse_prefixes()
+            struct job_controls controls;
+            if (parse_prefixes(&stages[0], &controls) == -1){
+                serve_reply("error");
+                continue;
             }
+            args = stages[0].args;
 
-            // otherwise, if not a built in command, run a new process
-            else{
-                // we need to fork off a process
-                // referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-process-api-creating-and-terminating-processes?module_item_id=22511468
-                // and https://canvas.oregonstate.edu/courses/1890465/pages/exploration-process-api-monitoring-child-processes?module_item_id=22511469
-                // and https://canvas.oregonstate.edu/courses/1890465/pages/exploration-process-api-executing-a-new-program?module_item_id=22511470
-                
-                // Fork a new process
-                pid_t childPid = fork();
-
-                if (childPid == -1){
-                    // only happens if fork process fails
-                    printf("[fork failed]\n");
-                    fflush(stdout);
-                    exit(1);
-                }
-                else if (childPid == 0){
-                    // Child process runs this code
-                    
-                    // continue to ignore ^C for background processes,
-                    // SIG_IGN will continue past execvp call
-                    // for foreground processes we need to set behavior back to default (SIG_DFL), 
-                    if (!background_process || foreground_only){  
-                        // Register SIG_DFL as the signal handler
-                        SIGINT_action.sa_handler = SIG_DFL;
-                        // Install our signal handler
-                        sigaction(SIGINT, &SIGINT_action, NULL);
-                    }
+            // a command made up of nothing but redirections just opens (and creates) its files,
+            // like in bash, e.g. "> file" empties out file
+            if (stage_count == 1 && !args[0]){
+                foreground_exit_status = open_stage_files(&stages[0]) ? 1 << 8 : 0;
+            }
 
-                    // ignore ^Z for all child processes,
-                    // SIG_IGN will continue past execvp call
-                    // Register SIG_IGN as the signal handler
-                    SIGTSTP_action.sa_handler = SIG_IGN;
-                    // Install our signal handler
-                    sigaction(SIGTSTP, &SIGTSTP_action, NULL);
-
-                    // Handle input/output files
-                    // referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-processes-and-i-slash-o?module_item_id=22511479
-                    if (strcmp(input_file, "")){
-                        // Open source file
-                        int sourceFD = open(input_file, O_RDONLY);
-                        if (sourceFD == -1) {
-                            fprintf(stderr, "smallsh: ");
-                            fflush(stderr);
-                            perror(input_file);
-                            exit(1); 
-                        }
-
-                        // Redirect stdin to source file
-                        int result = dup2(sourceFD, 0);
-                        if (result == -1) { 
-                            printf("[input file redirection failed]\n");
-                            fflush(stdout);
-                            exit(2); 
-                        }
-                    }
+            // built in commands run right here in the shell, see shell_builtin() and run_builtin()
+            else if ((builtin = shell_builtin(stages, stage_count, &controls, command.background))){
+                // built ins use the shell's own resources, so measure what the shell used while it ran
+                struct usage usage;
+                struct rusage before;
+                clock_gettime(CLOCK_MONOTONIC, &usage.start);
+                getrusage(RUSAGE_SELF, &before);
 
-                    if (strcmp(output_file, "")){
-                        // Open target file
-                        int targetFD = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                        if (targetFD == -1) { 
-                            printf("[output file open failed]\n");
-                            fflush(stdout);
-                            exit(1); 
-                        }
-                    
-                        // Redirect stdout to target file
-                        int result = dup2(targetFD, 1);
-                        if (result == -1) { 
-                            printf("[output file redirection failed]\n");
-                            fflush(stdout);
-                            exit(2); 
-                        }
-                    }
+                int result = run_builtin(builtin, &stages[0]);
 
-                    execvp(args[0], args);
-                    // execvp only returns if it fails, so next lines will only run in that case
-                    fprintf(stderr, "smallsh: ");
-                    fflush(stderr);
-                    perror(args[0]);
-                    if (strcmp(input_file, "")){
-                        perror(input_file);
-                    }
-                    if (strcmp(output_file, "")){
-                        perror(output_file);
-                    }
-                    exit(2);
-                }
-                else {
-                    // parent process runs this code  
-
-                    // if process is supposed to run in the background, 
-                    // and we are not in foreground_only mode, 
-                    // run with WNOHANG
-                    // referenced from https://canvas.oregonstate.edu/courses/1890465/pages/exploration-process-api-monitoring-child-processes?module_item_id=22511469
-                    // and add process id to processes array for checking later
-                    if (background_process && !foreground_only){
-                        printf("Background pid is %d\n", childPid);
-                        fflush(stdout);
-                        for(int j=0; j < 5; j++){
-                            if(!processes[j]){
-                                processes[j] = childPid;
-                                break;
-                            }
-                        }
-                        // use background_exit_status int from earlier to track status in main program, so we can print with status command
-                        childPid = waitpid(childPid, &background_exit_status, WNOHANG);
-                    }
-                    else{ 
-                        
-                        // wait for child's termination
-                        // use foreground_exit_status int from earlier to track status in main program, so we can print with status command
-                        childPid = waitpid(childPid, &foreground_exit_status, 0);
-                        // since we are running a foreground process, we need to print a message if it is terminated by a signal
-                        if(!WIFEXITED(foreground_exit_status)){
-                            printf("terminated by signal %d\n", WTERMSIG(foreground_exit_status));
-                            fflush(stdout);
-                        } 
-                    }
-                } 
-            }    
+                clock_gettime(CLOCK_MONOTONIC, &usage.end);
+                getrusage(RUSAGE_SELF, &usage.rusage);
+                timersub(&usage.rusage.ru_utime, &before.ru_utime, &usage.rusage.ru_utime);
+                timersub(&usage.rusage.ru_stime, &before.ru_stime, &usage.rusage.ru_stime);
+                usage.rusage.ru_nvcsw -= before.ru_nvcsw;
+                usage.rusage.ru_nivcsw -= before.ru_nivcsw;
+                if (controls.timed){
+                    print_usage(stderr, &usage);
+                }
+                // the trivial ones count as foreground commands, just like their external versions would
+                if (builtin->sets_status){
+                    foreground_exit_status = result << 8;
+                    foreground_timed_out = 0;
+                    foreground_usage = usage;
+                    record_status(foreground_exit_status);
+                }
+            }
+
+            // otherwise, if not a built in command, run a new process for every stage of the pipeline
+            else{
+                run_pipeline(stages, stage_count, command.background, &controls);
+                if (command.background && !foreground_only){
+                    serve_reply("background");
+                    continue;
+                }
+            }
+            // in server mode, send back how it went
+            serve_reply(NULL);
         }
     }
 
+    // scripts (and -j sessions) end with a summary of how their commands went
+    // (a server worker's summary would only clutter the server's output)
+    if ((batch_mode || max_jobs > 1) && serve_fd == -1){
+        return print_summary();
+    }
     return 0;
 }
-